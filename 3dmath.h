@@ -1,4 +1,12 @@
-typedef double* V3;
+//Real is the floating point type of every vector and of the math done with them.
+//It is float when built with -DSINGLE_PRECISION and double otherwise.
+#ifdef SINGLE_PRECISION
+typedef float Real;
+#else
+typedef double Real;
+#endif
+
+typedef Real* V3;
 
 //3D math inline functions
 static inline void v3_add(V3 a, V3 b, V3 c)
@@ -15,14 +23,14 @@ static inline void v3_subtract(V3 a, V3 b, V3 c)
     c[2] = a[2] - b[2];
 }
 
-static inline void v3_scale(V3 a, double s, V3 c)
+static inline void v3_scale(V3 a, Real s, V3 c)
 {
     c[0] = s * a[0];
     c[1] = s * a[1];
     c[2] = s * a[2];
 }
 
-static inline double v3_dot(V3 a, V3 b)
+static inline Real v3_dot(V3 a, V3 b)
 {
     return a[0]*b[0] + a[1]*b[1] + a[2]*b[2];
 }
@@ -36,8 +44,8 @@ static inline void v3_cross(V3 a, V3 b, V3 c)
 
 static inline void v3_reflect(V3 n, V3 b, V3 r)
 {
-    double temp[3] = {0, 0, 0};
-    double scalar;
+    Real temp[3] = {0, 0, 0};
+    Real scalar;
     v3_scale(n, 2.0, temp);
     scalar = v3_dot(temp, b);
     v3_scale(n, scalar, temp);
@@ -45,15 +53,15 @@ static inline void v3_reflect(V3 n, V3 b, V3 r)
 }
 
 //This function returns the input value squared
-static inline double sqr(double v)
+static inline Real sqr(Real v)
 {
     return v*v;
 }
 
 //this function normalizes the input vector
-static inline void normalize(double* v)
+static inline void normalize(Real* v)
 {
-    double len = sqrt(sqr(v[0]) + sqr(v[1]) + sqr(v[2]));
+    Real len = sqrt(sqr(v[0]) + sqr(v[1]) + sqr(v[2]));
     v[0] /= len;
     v[1] /= len;
     v[2] /= len;
@@ -0,0 +1,176 @@
+/* packet.h is the primary ray packet kernel.  raytrace.c includes it once per instruction set, and before
+ * each include it defines:
+ *     PACKET_WIDTH      the number of rays in a packet (one Real per lane of the vector unit)
+ *     PACKET_SUFFIX     the suffix given to the functions below, e.g. avx2
+ *     PacketD, PacketI  GCC vector types holding PACKET_WIDTH Reals and PACKET_WIDTH integers of the same size
+ *     packet_sqrt(v)    the square root of every lane
+ *
+ * The kernels perform exactly the same floating point operations, in the same order, as the scalar
+ * sphere_intersection(), plane_intersection() and normalize(), so each lane agrees with the scalar path
+ * to within PACKET_TOLERANCE (and bit for bit as long as floating point contraction stays disabled). */
+
+#define PACKET_CAT2(name, suffix) name##_##suffix
+#define PACKET_CAT(name, suffix) PACKET_CAT2(name, suffix)
+#define PACKET_FN(name) PACKET_CAT(name, PACKET_SUFFIX)
+
+//this function returns a where mask is set and b everywhere else
+static inline __attribute__((always_inline)) PacketD PACKET_FN(packet_select)(PacketI mask, PacketD a, PacketD b)
+{
+    return (PacketD)((mask & (PacketI)a) | (~mask & (PacketI)b));
+}
+
+//this function is the vector form of sphere_intersection(), it returns each lane's t-value or -1 for a miss
+static inline __attribute__((always_inline)) PacketD PACKET_FN(packet_sphere_intersection)(PacketD* Ro, PacketD* Rd,
+        Real* C, Real r2)
+{
+    PacketD oc[3] = {Ro[0] - C[0], Ro[1] - C[1], Ro[2] - C[2]};
+    PacketD b = oc[0]*Rd[0] + oc[1]*Rd[1] + oc[2]*Rd[2];
+    PacketD c = oc[0]*oc[0] + oc[1]*oc[1] + oc[2]*oc[2] - r2;
+
+    PacketD det = b*b - c;
+    PacketI hit = det >= 0;
+    PacketD zero = {0};
+    det = packet_sqrt(PACKET_FN(packet_select)(hit, det, zero));
+
+    PacketD t0 = -b - det;
+    PacketD t1 = -b + det;
+    PacketD miss = zero - 1;
+
+    PacketD t = PACKET_FN(packet_select)(t1 > 0, t1, miss);
+    t = PACKET_FN(packet_select)(t0 > 0, t0, t);
+    return PACKET_FN(packet_select)(hit, t, miss);
+}
+
+//this function is the vector form of plane_intersection()
+static inline __attribute__((always_inline)) PacketD PACKET_FN(packet_plane_intersection)(PacketD* Ro, PacketD* Rd,
+        Real* N, Real D)
+{
+    return -(N[0]*Ro[0] + N[1]*Ro[1] + N[2]*Ro[2] + D) / (N[0]*Rd[0] + N[1]*Rd[1] + N[2]*Rd[2]);
+}
+
+//this function is the vector form of closer_hit(), keeping each lane's closest t-value and object
+static inline __attribute__((always_inline)) void PACKET_FN(packet_closer_hit)(PacketD t, int i, PacketD* best_t, PacketI* best_object)
+{
+    PacketI zero = {0};
+    PacketI index = zero + i;
+    PacketI closer = (t > 0) & ((t < *best_t) | ((t == *best_t) & (index < *best_object)));
+    *best_t = PACKET_FN(packet_select)(closer, t, *best_t);
+    *best_object = (closer & index) | (~closer & *best_object);
+}
+
+//this function is the vector form of box_intersection().  It returns the lanes whose ray enters the
+//box before their limit and stores the nearest such entry distance into entry.
+static inline __attribute__((always_inline)) PacketI PACKET_FN(packet_box_intersection)(PacketD* Ro, PacketD* invRd,
+        Real* bmin, Real* bmax, PacketD limit, Real* entry)
+{
+    PacketD tmin = {0};
+    PacketD tmax = limit;
+    int k;
+    for (k = 0; k < 3; k += 1)
+    {
+        PacketD t0 = (bmin[k] - Ro[k]) * invRd[k];
+        PacketD t1 = (bmax[k] - Ro[k]) * invRd[k];
+        PacketI swap = t0 > t1;
+        PacketD lo = PACKET_FN(packet_select)(swap, t1, t0);
+        PacketD hi = PACKET_FN(packet_select)(swap, t0, t1);
+        tmin = PACKET_FN(packet_select)(lo > tmin, lo, tmin);
+        tmax = PACKET_FN(packet_select)(hi < tmax, hi, tmax);
+    }
+    PacketI hit = tmin <= tmax;
+    *entry = INFINITY;
+    for (k = 0; k < PACKET_WIDTH; k += 1)
+    {
+        if (hit[k] && tmin[k] < *entry) *entry = tmin[k];
+    }
+    return hit;
+}
+
+//this function generates the primary rays through pixels (x, y) to (x+PACKET_WIDTH-1, y) and finds the closest
+//object hit by each of them.  Lanes past the right edge of the image repeat the last pixel.  The direction, t-value
+//and object of each ray are stored into Rd[k*3], best_t[k] and best_object[k].
+void PACKET_FN(trace_packet)(RenderJob* job, int x, int y, Real* Rd, Real* best_t, int* best_object)
+{
+    Scene* scene = job->scene;
+    PacketD zero = {0};
+    PacketD Ro[3] = {zero, zero, zero};
+    PacketD dir[3];
+    int k;
+    for (k = 0; k < PACKET_WIDTH; k += 1)
+    {
+        int px = x + k < pwidth ? x + k : pwidth - 1;
+        dir[0][k] = px + job->originX + (Real)0.5;
+    }
+    // Rd = normalize(P - Ro)
+    dir[0] = job->cx - (job->w/2) + job->pixwidth * dir[0];
+    dir[1] = zero + (job->cy - (job->h/2) + job->pixheight * (y + job->originY + (Real)0.5));
+    dir[2] = zero + 1;
+    PacketD len = packet_sqrt(dir[0]*dir[0] + dir[1]*dir[1] + dir[2]*dir[2]);
+    dir[0] /= len;
+    dir[1] /= len;
+    dir[2] /= len;
+
+    PacketD t;
+    PacketD bt = zero + INFINITY;
+    PacketI bo = (PacketI)zero - 1;
+    int sphereTests = 0;
+
+    int i;
+    for (i = 0; i < scene->numOfPlanes; i += 1)
+    {
+        t = PACKET_FN(packet_plane_intersection)(Ro, dir, &scene->planeNormal[i*3], scene->planeOffset[i]);
+        PACKET_FN(packet_closer_hit)(t, scene->planeObject[i], &bt, &bo);
+    }
+
+    PacketD invRd[3] = {1/dir[0], 1/dir[1], 1/dir[2]};
+    int stack[BVH_STACK];
+    int top = 0;
+    Real entry;
+    entry = INFINITY;
+    if (scene->numOfSpheres > 0) PACKET_FN(packet_box_intersection)(Ro, invRd, scene->nodes[0].bmin, scene->nodes[0].bmax, bt, &entry);
+    if (entry != INFINITY) stack[top++] = 0;
+    while (top > 0)
+    {
+        BvhNode* node = &scene->nodes[stack[--top]];
+        if (node->count > 0) //if the node is a leaf, intersect every lane with each of its spheres
+        {
+            for (i = node->first; i < node->first + node->count; i += 1)
+            {
+                t = PACKET_FN(packet_sphere_intersection)(Ro, dir, &scene->sphereCenter[i*3], scene->sphereR2[i]);
+                sphereTests += 1;
+                PACKET_FN(packet_closer_hit)(t, scene->sphereObject[i], &bt, &bo);
+            }
+            continue;
+        }
+        //visit a child if any lane enters it, nearer child first
+        BvhNode* left = &scene->nodes[node->first];
+        BvhNode* right = &scene->nodes[node->first + 1];
+        Real tleft, tright;
+        PACKET_FN(packet_box_intersection)(Ro, invRd, left->bmin, left->bmax, bt, &tleft);
+        PACKET_FN(packet_box_intersection)(Ro, invRd, right->bmin, right->bmax, bt, &tright);
+        if (tleft <= tright)
+        {
+            if (tright != INFINITY) stack[top++] = node->first + 1;
+            if (tleft != INFINITY) stack[top++] = node->first;
+        }
+        else
+        {
+            if (tleft != INFINITY) stack[top++] = node->first;
+            stack[top++] = node->first + 1;
+        }
+    }
+
+    if (collect_stats) //every test is done for all of the packet's lanes
+    {
+        ray_stats.planeTests += (unsigned long long)scene->numOfPlanes * PACKET_WIDTH;
+        ray_stats.sphereTests += (unsigned long long)sphereTests * PACKET_WIDTH;
+    }
+
+    for (k = 0; k < PACKET_WIDTH; k += 1)
+    {
+        Rd[k*3] = dir[0][k];
+        Rd[k*3+1] = dir[1][k];
+        Rd[k*3+2] = dir[2][k];
+        best_t[k] = bt[k];
+        best_object[k] = (int)bo[k];
+    }
+}
@@ -4,10 +4,40 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <math.h>
+#include <tgmath.h>
 #include <ctype.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #include "3dmath.h"
 #define MAX_RECURSION 7
+#define TILE_SIZE 16        //width and height in pixels of the tiles handed out to render threads
+#define BVH_LEAF_SIZE 4     //number of spheres at or below which a bvh node is not split any further
+#define BVH_BINS 16         //number of buckets used to estimate the surface area heuristic when splitting
+#define BVH_STACK 64        //maximum depth of the bvh traversal stack
+#define MAX_PACKET (64/(int)sizeof(Real)) //largest number of primary rays traced together by a packet kernel
+#define PACKET_TOLERANCE 1e-9 //largest relative difference allowed between packet and scalar t-values
+#ifdef SINGLE_PRECISION
+#define RAY_EPSILON 1e-4      //distance a shadow, reflection, or refraction ray is started away from the surface it leaves
+#else
+#define RAY_EPSILON 1e-6
+#endif
+#define PROGRESSIVE_STEP 8  //spacing of the pixels rendered by the first pass of a progressive render
+#define AA_THRESHOLD 0.1      //default difference in a color channel between neighboring pixels that makes them get more samples
+#define AA_DEPTH 0.1          //relative difference in depth between neighboring pixels that makes them get more samples
+#define LIGHT_CUTOFF (0.5/255) //most the lights skipped without a shadow ray can add to a color channel at a point, together
+#define PRUNE_THRESHOLD (1.0/512) //default weight below which a reflection or refraction isn't followed, half of one 8-bit step
+#define DEFERRED_CHUNK 256  //number of G-buffer texels handed to a render thread at a time by the deferred shading pass
+#define OUTPUT_BLOCK (1 << 20) //size of the output file buffer and of each compressed png IDAT chunk
+#define DEFLATE_WINDOW 32768 //farthest back a png back reference may point
+#define DEFLATE_HASH_BITS 15 //log2 of the number of entries in the png match finder's hash table
+#define SCENE_FILE_VERSION 1 //version of the compiled scene file layout, changed whenever a struct stored in it changes
+#define SCENE_FILE_ALIGN 64  //alignment of the header and of each array in a compiled scene file
+#define SCENE_SECTIONS 12    //number of arrays stored in a compiled scene file
 
 //data type to store pixel rgb values
 typedef struct Pixel
@@ -22,28 +52,28 @@ typedef struct
     //double reflectivity;
     //double refractivity;
     //double ior;
-    double diffuse_color[3];
-    double specular_color[3];
+    Real diffuse_color[3];
+    Real specular_color[3];
     union
     {
         struct
         {
-            double center[3];
-            double width;
-            double height;
+            Real center[3];
+            Real width;
+            Real height;
         } camera;
         struct
         {
-            double center[3];
-            double radius;
-            double reflectivity;
-            double refractivity;
-            double ior;
+            Real center[3];
+            Real radius;
+            Real reflectivity;
+            Real refractivity;
+            Real ior;
         } sphere;
         struct
         {
-            double center[3];
-            double normal[3];
+            Real center[3];
+            Real normal[3];
         } plane;
     };
 } Object;
@@ -52,12 +82,12 @@ typedef struct
 typedef struct
 {
     int kind; // 0 = radial, 1 = spotlight
-    double color[3];
-    double position[3];
-    double radial_a2;
-    double radial_a1;
-    double radial_a0;
-    double theta;
+    Real color[3];
+    Real position[3];
+    Real radial_a2;
+    Real radial_a1;
+    Real radial_a0;
+    Real theta;
     union
     {
         struct
@@ -65,79 +95,873 @@ typedef struct
         } radial;
         struct
         {
-            double angular_a0;
-            double direction[3];
+            Real angular_a0;
+            Real direction[3];
         } spotlight;
     };
 } Light;
 
+//data type to store a light compiled for shading.  Everything about the light that doesn't depend on the point
+//being lit is worked out once by compile_scene().
+typedef struct
+{
+    int kind;          // 0 = radial, 1 = spotlight
+    Real position[3];
+    Real color[3];
+    Real a0, a1, a2;   // radial attenuation is 1/(a2*d*d + a1*d + a0) at distance d
+    Real direction[3]; // normalized spotlight direction
+    Real cos_theta;    // cosine of the spotlight's angle, points outside of its cone get no light
+    Real angular_a0;   // exponent of the spotlight's angular attenuation
+} CompiledLight;
+
+//data type to store the shading attributes of an object.  The intersection loops never touch these,
+//they are only looked up for the object a ray actually hit.
+typedef struct
+{
+    int kind;     // 1 = sphere, 2 = plane
+    int geometry; // index of the object's sphere or plane in the scene's geometry arrays
+    Real diffuse_color[3];
+    Real specular_color[3];
+    Real reflectivity;
+    Real refractivity;
+    Real ior;
+} Material;
+
+//data type to store the result of a ray query
+typedef struct
+{
+    Real t;   // distance along the ray to the closest hit, INFINITY if nothing was hit
+    int object; // index of the object that was hit, -1 if nothing was hit
+} Hit;
+
+//data type to store a scene file mapped into memory and the parser's position in it
+typedef struct
+{
+    char* data;
+    size_t length;
+    size_t position;
+} SceneFile;
+
+//data type to store a string from the scene file.  It points into the mapped file rather than being copied out,
+//so it is not null terminated.
+typedef struct
+{
+    char* start;
+    int length;
+} JsonString;
+
+//data type to describe an output image format.  Rows are handed to the writer from the top of the image down.
+typedef struct
+{
+    char* name;       // name given to --format
+    char* extension;  // file extension that selects the format when --format isn't given
+    int hdr;          // 1 if the format stores the unclamped floating point colors
+    void (*begin)(void);
+    void (*row)(Pixel* row, float* hdr, int y);
+    int (*end)(void);
+} OutputFormat;
+
+//data type to store the state of the png encoder between rows
+typedef struct
+{
+    unsigned char* history;   // filtered rows, the last DEFLATE_WINDOW bytes already compressed followed by the pending ones
+    int capacity;
+    int length;               // number of bytes in history
+    int position;             // index of the first byte in history that hasn't been compressed
+    long long base;           // offset of history[0] from the start of the uncompressed stream
+    long long* head;          // last stream offset at which each hash of three bytes was seen
+    unsigned long long bits;  // bits waiting to be written
+    int bitCount;
+    unsigned int adlerA, adlerB;
+    unsigned char* idat;      // compressed bytes waiting to be written as an IDAT chunk
+    int idatLength;
+} PngEncoder;
+
+//data type to store a node of the bounding volume hierarchy.  Interior nodes keep their two children next to each other
+//in the node array; leaves keep their spheres next to each other in the scene's geometry arrays.
+typedef struct
+{
+    Real bmin[3];
+    Real bmax[3];
+    int first; // interior: index of the first child node, leaf: index of the first sphere in the geometry arrays
+    int count; // number of spheres in a leaf, 0 for interior nodes
+} BvhNode;
+
+//data type to store a parsed scene along with the compiled form of it that rays are traced against.
+//Compiling copies the geometry out of the objects into one contiguous array per field, so the intersection
+//loops only stream the numbers they need, and moves the shading attributes into a separate material table.
+typedef struct
+{
+    int numOfObjects;
+    int numOfLights;
+    Object* objects;
+    Light* lights;
+    BvhNode* nodes;        // bvh over the spheres, nodes[0] is the root
+    int numOfNodes;
+    int numOfSpheres;
+    Real* sphereCenter;  // x, y, z of each sphere, in bvh leaf order
+    Real* sphereR2;      // radius squared of each sphere
+    Real* sphereInvRadius; // 1/radius of each sphere, which scales the vector from its center to a hit into the normal
+    int* sphereObject;     // index of the object, and so of the material, each sphere came from
+    int numOfPlanes;       // planes are unbounded and are tested against every ray
+    Real* planeNormal;   // x, y, z of each plane's unit normal N
+    Real* planeOffset;   // D of each plane's equation N.X + D = 0
+    int* planeObject;      // index of the object, and so of the material, each plane came from
+    Material* materials;   // shading attributes, indexed like objects
+    CompiledLight* compiledLights; // lights ready for shading, indexed like lights
+    void* mapping;         // compiled scene file every array above points into, NULL if compile_scene() allocated them
+    size_t mappingLength;
+} Scene;
+
+//data type to store one ray of the wavefront engine, along with what is needed to shade it and to combine its color
+//with its parent's.  A ray's reflection and refraction are stored next to each other, after it in the ray array.
+typedef struct
+{
+    Real Ro[3];      // origin the ray is shot from
+    Real shadeRo[3]; // origin the hit is shaded from, reflections are shaded from just past the point they leave
+    Real Rd[3];
+    Real t;          // closest hit, INFINITY if nothing was hit
+    int object;        // object that was hit, -1 if nothing was hit
+    int level;         // recursion depth, 0 for primary rays
+    int pixel;         // x + y*pwidth of the pixel the ray's tree belongs to
+    int children;      // index of the ray's reflection, followed by its refraction, -1 if it spawned neither
+    unsigned int path; // position of the ray in its pixel's tree, 1 for the primary ray and path*2 (+1) for its reflection (refraction)
+    Real weight;     // largest share of the pixel's color the ray can carry
+    Real scale;      // factor its color is multiplied by before being combined with its parent's, 0 if the ray was cut
+    Real color[3];
+} WaveRay;
+
+//data type to store the counters kept on the render's hot paths.  Each render thread counts into its own copy,
+//and the copies are added together once the threads finish.  Only the ray counts are kept without --stats.
+typedef struct
+{
+    unsigned long long primary, shadow, reflection, refraction; // rays cast of each kind
+    unsigned long long sphereTests, planeTests;                 // ray/sphere and ray/plane intersection tests
+    unsigned long long hits, misses;                            // rays that did and did not hit an object
+    unsigned long long depth[MAX_RECURSION+2];                  // calls to shade() at each level of recursion
+    unsigned long long spotlightSkipped;                        // lights left out of a point by a spotlight's cone
+    unsigned long long lightsCulled;                            // lights a point faces away from or that are too dim to matter
+    unsigned long long samples, refinedPixels;                  // anti-aliasing samples taken, and pixels that took more than one
+} RayStats;
+
+//data type to store what the first sample of a pixel saw, which anti-aliasing compares between neighboring pixels
+typedef struct
+{
+    Real color[3]; // color, not clamped
+    Real t;        // distance to the hit, INFINITY for a miss
+    int object;      // object hit, -1 for a miss
+} Sample;
+
+//data type to store what the primary ray through the center of a pixel hit, which --hit-cache keeps between renders
+typedef struct
+{
+    Real t;         // distance to the hit, INFINITY for a miss
+    int object;     // object hit, -1 for a miss
+    Real normal[3]; // normalized surface normal at the hit, 0 for a miss
+} PrimaryHit;
+
+//data type to store one texel of the deferred renderer's G-buffer, what the primary ray through a pixel's center hit
+typedef struct
+{
+    Real position[3]; // point hit
+    Real normal[3];   // normalized surface normal at the point
+    Real t;           // distance to the hit, INFINITY for a miss
+    int object;       // object hit, which is also the index of its material, -1 for a miss
+} GBufferTexel;
+
+//data type to store the header of a hit cache file, which is followed by one PrimaryHit per pixel, top row first
+typedef struct
+{
+    char magic[8];           // "RTHITS1", the 1 being the version of the file layout
+    unsigned long long hash; // hit_cache_hash() of the geometry, camera, and image size the hits belong to
+    int width, height;
+    int realSize;            // sizeof(Real) of the build that wrote the file
+} HitCacheHeader;
+
+//data type to store the header of a compiled scene file.  It is followed by the scene's arrays, each starting at a
+//multiple of SCENE_FILE_ALIGN bytes, so they can be traced against right where the file is mapped.
+typedef struct
+{
+    char magic[8];               // "RTSCENE"
+    int version;                 // SCENE_FILE_VERSION of the build that wrote the file
+    int realSize;                // sizeof(Real) of the build that wrote the file
+    unsigned long long length;   // size of the whole file in bytes
+    unsigned long long checksum; // scene_checksum() of the whole file, taken with this field set to 0
+    long long sourceSize;        // size and modification time in nanoseconds of the json file the scene was compiled from
+    long long sourceTime;
+    char source[4096];           // absolute path of that json file, empty if it couldn't be resolved
+    int numOfObjects, numOfLights, numOfNodes, numOfSpheres, numOfPlanes;
+    unsigned long long offset[SCENE_SECTIONS]; // position of each of the arrays listed by scene_sections()
+} CompiledSceneHeader;
+
+//data type to store one render thread's queue of tiles.  The owner takes tiles from the front and
+//other workers steal from the back; both ends are packed into one word so a take is a single compare-and-swap.
+typedef struct
+{
+    _Atomic unsigned long long range; // low 32 bits = next tile, high 32 bits = one past the last tile
+    char padding[56];                 // keep each queue on its own cache line
+} TileQueue;
+
+//data type to store everything the render threads share for one image
+typedef struct
+{
+    Scene* scene;
+    Pixel* data;
+    float* hdr;                   // unclamped colors, 3 per pixel, only kept for floating point output formats
+    Real cx, cy, w, h;          // camera position and viewplane size
+    Real pixwidth, pixheight;   // size of one pixel on the viewplane
+    int originX, originY;         // position in the full frame of the image's pixel (0, 0), its bottom left, with y growing upward
+    int frameWidth;               // width of the full frame, which numbers the pixels that seed random numbers
+    int tilesX, tilesY, numOfTiles;
+    int numOfWorkers;
+    TileQueue* queues;            // one queue per worker
+    int step;                     // pixel spacing of the progressive pass being rendered, 0 renders every pixel at once
+    Sample* samples;              // first sample of every pixel, top row first, only kept when anti-aliasing
+    int refine;                   // 1 while the pixels that need more samples are being anti-aliased
+    int keepX0, keepY0, keepX1, keepY1; // pixels kept in the image, which leaves out the border a region is anti-aliased with
+    PrimaryHit* hits;             // primary hit of every pixel, top row first, only kept with --hit-cache
+    int reuseHits;                // 1 if the hits were loaded from the cache, so primary rays aren't shot again
+    int deferred;                 // 1 while the G-buffer is filled, 2 while it is shaded, 0 when pixels are shaded as they are hit
+    GBufferTexel* gbuffer;        // one texel per pixel, top row first, only kept for deferred shading
+    int* order;                   // pixels whose primary ray hit something, grouped by material
+    int numOfOrdered;
+} RenderJob;
+
+//data type to store one property change a batch job makes to its scene before rendering it
+typedef struct
+{
+    int light;      // index of the light changed, -1 if an object is changed
+    int object;     // index of the object changed, -1 if a light is changed
+    char key[16];   // name of the property, as in the scene file
+    Real value[3];
+    int count;      // 1 for a number, 3 for a vector
+} Override;
+
+//data type to store one job of a batch manifest
+typedef struct
+{
+    char* scene;          // scene file, parsed once no matter how many jobs use it
+    char* output;
+    int width, height;
+    Override* overrides;
+    int numOfOverrides;
+    int sceneIndex;       // index of the job's scene among the batch's distinct scenes
+    OutputFormat* format;
+} BatchJob;
+
+//data type to store a scene shared by the jobs of a batch, along with its objects and lights as parsed
+//so that each job's overrides can be undone before the next job's are applied
+typedef struct
+{
+    char* filename;
+    Scene scene;
+    Object* objects;
+    Light* lights;
+    int dirty;            // 1 if the scene still has a job's overrides applied to it
+} BatchScene;
+
+//data type to store a render thread's arguments
+typedef struct
+{
+    RenderJob* job;
+    int id;
+    RayStats stats; // the worker's counters, copied out when it finishes
+} Worker;
+
 FILE* outputfp;
 int pwidth, pheight, maxcv; //global variables to store p3 header information
+int frame_width, frame_height; //global variables to store the size of the full frame that the image is a --region of
+int region_x, region_y;     //global variables to store where the image's top left pixel lies in the full frame
 int line = 1;               //global variable to store line of json file currently being parsed
 int ns = 20;                //global variable to store phong reflectivity
+int nthreads = 1;           //global variable to store the number of render threads
+int packet_width = 1;       //global variable to store the number of primary rays per packet, 1 when packets are off
+char packet_kernel[8] = "off"; //global variable to store the name of the packet kernel in use
+OutputFormat* output_format;   //global variable to store the format the image is written in
+unsigned char* output_row;     //global variable to store one encoded row of the image
+long pfm_start;                //global variable to store the offset of the first pfm row in the output file
+Pixel qoi_index[64];           //global variables to store the state of the qoi encoder
+unsigned char qoi_used[64];
+Pixel qoi_prev;
+int qoi_run;
+PngEncoder png;                //global variable to store the state of the png encoder
+void (*trace_packet)(RenderJob* job, int x, int y, Real* Rd, Real* best_t, int* best_object); //packet kernel in use
+int collect_stats = 0;       //global variable to store whether the --stats counters are kept
+__thread RayStats ray_stats; //global variable to store the calling thread's counters
+int wavefront = 0;           //global variable to store whether tiles are rendered by the wavefront engine
+__thread WaveRay* wave_rays; //global variables to store the calling thread's wavefront ray array, kept between tiles and images
+__thread int wave_capacity;
+double prune_threshold = PRUNE_THRESHOLD; //global variable to store the weight below which rays are cut, 0 follows every ray
+int roulette = 0;            //global variable to store whether rays below the threshold play russian roulette instead of being cut
+__thread unsigned int roulette_pixel; //global variable to store the pixel whose rays the calling thread is shading
+int progressive = 0;         //global variable to store whether the image is rendered in progressively finer passes
+char* preview_filename;      //global variable to store the file each progressive pass is written out to, NULL for none
+int aa_samples = 1;          //global variable to store the largest number of samples per pixel, 1 turns anti-aliasing off
+double aa_threshold = AA_THRESHOLD; //global variable to store the color difference that makes a pixel get more samples
+char* hit_cache_filename;    //global variable to store the file primary hits are kept in between renders, NULL for none
+int deferred = 0;            //global variable to store whether every primary hit is found before any pixel is shaded
+char* gbuffer_dump;          //global variable to store the prefix of the files the G-buffer is dumped to, NULL for none
+int stream_rows = 0;         //global variable to store the height of the bands --stream renders and writes at a time, 0 for none
+int stream_band;             //global variable to store the index of the band being streamed, only the first reports progress
+int fast_math = 0;           //global variable to store whether shading uses the faster approximate math of --fast-math
+int fast_math_check = 0;     //global variable to store whether the --fast-math image is compared with a precise render
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER; //global variables to store the render threads, which are kept between render_job() calls
+pthread_cond_t pool_wake = PTHREAD_COND_INITIALIZER;   //signalled when a job is handed out or the threads are stopped
+pthread_cond_t pool_idle = PTHREAD_COND_INITIALIZER;   //signalled when the last pool thread finishes its share of a job
+pthread_t* pool_threads;
+Worker* pool_workers;        //one per thread, pool_workers[0] belongs to the thread calling render_job()
+int pool_size;               //number of workers including the calling thread, 0 until the threads are started
+RenderJob* pool_job;         //job being rendered
+unsigned int pool_generation; //number of jobs handed out so far
+int pool_busy;               //number of pool threads still rendering the current job
+int pool_quit;               //1 once the threads have been told to exit
 
 //this function clamps the input value between 0 and 1
-double clamp(double input)
+Real clamp(Real input)
 {
     if(input < 0.0) return 0.0;
     else if (input > 1.0) return 1.0;
     else return input;
 }
-//this function calculates the amount of radial attenuation of a light for a given coordinate
-//based off of the parameters, calculating the distance between where the camera intersects the relevant object
-//and the light's position, then calculating the value to return based off of that and the passed in radial values
-double frad(double a0, double a1, double a2, double t, double* Ro, double* Rd, double* pos)
+//this function calculates the amount of radial attenuation of a light at the given distance from it
+static inline Real frad(CompiledLight* light, Real d)
 {
-    if(t == INFINITY) return 1.0;
-    else
+    return 1/(light->a2*(d*d) + light->a1*d + light->a0);
+}
+
+//this function raises x to the power e, a whole number that isn't negative, by repeated squaring
+static inline Real pow_int(Real x, int e)
+{
+    Real result = 1;
+    while (e > 0)
     {
-        double result, d;
-        double intersection[3] = {0, 0, 0};
-        double tRd[3] = {0, 0, 0};
-        v3_scale(Rd, t, tRd);
-        v3_add(Ro, tRd, intersection);
-        d = sqrt(pow(pos[0]-intersection[0], 2) + pow(pos[1]-intersection[1], 2) + pow(pos[2]-intersection[2], 2));
-        result = 1/(a2*(d*d) + a1*d + a0);
-        return result;
+        if (e & 1) result *= x;
+        x *= x;
+        e >>= 1;
     }
+    return result;
 }
 
-//this function calculates the amount of angular attenuation of a spotlight for a given coordinate
-//returns 1.0 if the input light was a radial light and 0.0 if the coordinate falls outside of the spotlight's cone.
-//If the coordinate falls inside the cone, the amount to color by is returned
-double fang(int kind, double theta, double* vlight, double* vobject, double angular_a0)
+//this function approximates x to the power y for x > 0 as 2^(y*log2(x)).  log2 is the exponent of x plus a series
+//in the mantissa, and 2^f for the fraction left after rounding is a short polynomial, both good to about 1e-6.
+static inline Real fast_pow(Real x, Real y)
 {
-    normalize(vlight);
-    if(kind != 1) return 1.0;
-    else if(v3_dot(vobject, vlight) < cos(theta*(M_PI/180))) return 0.0;
-    else
+    union {double d; unsigned long long u;} bits = {x};
+    int exponent = (int)((bits.u >> 52) & 0x7ff) - 1023;
+    bits.u = (bits.u & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL; //mantissa m, from 1 up to 2
+    if (bits.d > 1.4142135623730951) //center m around 1 so the series converges fast
+    {
+        bits.d *= 0.5;
+        exponent += 1;
+    }
+    double t = (bits.d - 1)/(bits.d + 1);
+    double t2 = t*t;
+    double log2x = exponent + t*(2.8853900817779268 + t2*(0.96179669392597561 + t2*(0.57707801635558537 + t2*0.41219858311113241)));
+
+    double z = y*log2x;
+    if (z < -1000 || z > 1000) return pow(x, y); //beyond the range of double's exponent, leave it to pow
+    double whole = floor(z + 0.5);
+    double f = (z - whole)*0.69314718055994531; //2^(z-whole) = e^f with |f| <= ln(2)/2
+    double e = 1 + f*(1 + f*(0.5 + f*(1.0/6 + f*(1.0/24 + f*(1.0/120 + f*(1.0/720))))));
+    bits.u = (unsigned long long)((int)whole + 1023) << 52; //2^whole
+    return e*bits.d;
+}
+
+//this function calculates the amount of angular attenuation of a spotlight for a point in the direction l
+//(normalized, from the point toward the light).  It returns 0.0 if the point falls outside of the spotlight's cone.
+static inline Real fang(CompiledLight* light, Real* l)
+{
+    Real cosine = -v3_dot(l, light->direction);
+    if(cosine < light->cos_theta) return 0.0;
+    if(fast_math) //whole exponents are squared out, others approximated
+    {
+        int e = (int)light->angular_a0;
+        if(e == light->angular_a0 && e >= 0 && e <= 64) return pow_int(cosine, e);
+        return cosine > 0 ? fast_pow(cosine, light->angular_a0) : 0;
+    }
+    return pow(cosine, light->angular_a0);
+}
+
+//This function writes the comment that tells where an image rendered with --region lies in the full frame, which
+//--merge reads back.  Nothing is written for an image of the whole frame.
+void region_comment(void)
+{
+    if (pwidth != frame_width || pheight != frame_height)
     {
-        return pow(v3_dot(vobject, vlight),angular_a0);
+        fprintf(outputfp, "# region %d %d %d %d of %d %d\n", region_x, region_y, region_x + pwidth, region_y + pheight,
+                frame_width, frame_height);
     }
-    return 1.0;
 }
 
-//This function writes data from the pixel buffer passed into the function to the output file in ascii.
-int write_p3(Pixel* image)
+//This function writes the header of an ascii p3 image to the output file.
+void p3_begin(void)
 {
     fprintf(outputfp, "%c%c\n", 'P', '3'); //write out the file header P type
+    region_comment();
     fprintf(outputfp, "%d %d\n", pwidth, pheight); //write the width and the height
     fprintf(outputfp, "%d\n", maxcv); //write the max color value
+}
+
+//This function writes one row of the pixel buffer to the output file in ascii.
+void p3_row(Pixel* row, float* hdr, int y)
+{
+    int x;
+    for(x = 0; x < pwidth; x++)   //write each pixel in the row to the output file
+    {
+        fprintf(outputfp, "%d\n%d\n%d\n", row[x].r, //in ascii
+                row[x].g,
+                row[x].b);
+    }
+}
+
+//This function finishes an image and reports whether every write to the output file succeeded.
+int output_end(void)
+{
+    free(output_row);
+    output_row = NULL;
+    return ferror(outputfp) == 0 ? 1 : 0;
+}
+
+//This function writes the header of a binary p6 image to the output file.
+void p6_begin(void)
+{
+    fprintf(outputfp, "P6\n");
+    region_comment();
+    fprintf(outputfp, "%d %d\n%d\n", pwidth, pheight, maxcv);
+    output_row = malloc(pwidth*3);
+}
+
+//This function writes one row of the pixel buffer to the output file as packed binary rgb bytes.
+void p6_row(Pixel* row, float* hdr, int y)
+{
+    int x;
+    for(x = 0; x < pwidth; x++)
+    {
+        output_row[x*3] = row[x].r;
+        output_row[x*3+1] = row[x].g;
+        output_row[x*3+2] = row[x].b;
+    }
+    fwrite(output_row, 1, pwidth*3, outputfp);
+}
+
+//This function writes the header of a pfm image, which stores the unclamped colors as little endian floats.
+void pfm_begin(void)
+{
+    fprintf(outputfp, "PF\n%d %d\n-1.0\n", pwidth, pheight);
+    pfm_start = ftell(outputfp);
+    output_row = malloc(pwidth*12);
+}
+
+//This function writes one row of the floating point color buffer to the output file.
+//pfm stores its rows from the bottom of the image up, so each row is written at its own offset.
+void pfm_row(Pixel* row, float* hdr, int y)
+{
+    int x, k;
+    for(x = 0; x < pwidth*3; x++)
+    {
+        unsigned int bits;
+        memcpy(&bits, &hdr[x], 4);
+        for(k = 0; k < 4; k++) output_row[x*4+k] = (unsigned char)(bits >> (8*k));
+    }
+    fseek(outputfp, pfm_start + (long)(pheight-1-y)*pwidth*12, SEEK_SET);
+    fwrite(output_row, 1, pwidth*12, outputfp);
+}
+
+//This function stores v into the 4 bytes at out, most significant byte first.
+void put_be32(unsigned char* out, unsigned int v)
+{
+    out[0] = (unsigned char)(v >> 24);
+    out[1] = (unsigned char)(v >> 16);
+    out[2] = (unsigned char)(v >> 8);
+    out[3] = (unsigned char)v;
+}
+
+//This function writes the header of a qoi image and resets the encoder.
+void qoi_begin(void)
+{
+    unsigned char header[14] = {'q', 'o', 'i', 'f'};
+    put_be32(&header[4], pwidth);
+    put_be32(&header[8], pheight);
+    header[12] = 3; //rgb
+    header[13] = 0; //srgb with linear alpha
+    fwrite(header, 1, 14, outputfp);
+    memset(qoi_index, 0, sizeof(qoi_index));
+    memset(qoi_used, 0, sizeof(qoi_used));
+    qoi_prev.r = 0;
+    qoi_prev.g = 0;
+    qoi_prev.b = 0;
+    qoi_run = 0;
+    output_row = malloc(pwidth*4 + 1);
+}
+
+//This function encodes one row of the pixel buffer with the qoi operations.  Runs and the previous pixel
+//carry over from one row to the next, exactly as if the image were one long row.
+void qoi_row(Pixel* row, float* hdr, int y)
+{
+    int x;
+    int n = 0;
+    for(x = 0; x < pwidth; x++)
+    {
+        Pixel px = row[x];
+        if(px.r == qoi_prev.r && px.g == qoi_prev.g && px.b == qoi_prev.b)
+        {
+            qoi_run++;
+            if(qoi_run == 62)
+            {
+                output_row[n++] = 0xc0 | (qoi_run - 1); //QOI_OP_RUN
+                qoi_run = 0;
+            }
+            continue;
+        }
+        if(qoi_run > 0)
+        {
+            output_row[n++] = 0xc0 | (qoi_run - 1);
+            qoi_run = 0;
+        }
+        int hash = (px.r*3 + px.g*5 + px.b*7 + 255*11) % 64;
+        if(qoi_index[hash].r == px.r && qoi_index[hash].g == px.g && qoi_index[hash].b == px.b && qoi_used[hash])
+        {
+            output_row[n++] = hash; //QOI_OP_INDEX
+        }
+        else
+        {
+            qoi_index[hash] = px;
+            qoi_used[hash] = 1;
+            signed char dr = (signed char)(px.r - qoi_prev.r);
+            signed char dg = (signed char)(px.g - qoi_prev.g);
+            signed char db = (signed char)(px.b - qoi_prev.b);
+            signed char dr_dg = (signed char)(dr - dg);
+            signed char db_dg = (signed char)(db - dg);
+            if(dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1)
+            {
+                output_row[n++] = 0x40 | ((dr + 2) << 4) | ((dg + 2) << 2) | (db + 2); //QOI_OP_DIFF
+            }
+            else if(dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7)
+            {
+                output_row[n++] = 0x80 | (dg + 32); //QOI_OP_LUMA
+                output_row[n++] = ((dr_dg + 8) << 4) | (db_dg + 8);
+            }
+            else
+            {
+                output_row[n++] = 0xfe; //QOI_OP_RGB
+                output_row[n++] = px.r;
+                output_row[n++] = px.g;
+                output_row[n++] = px.b;
+            }
+        }
+        qoi_prev = px;
+    }
+    fwrite(output_row, 1, n, outputfp);
+}
+
+//This function writes out the last run of a qoi image and its end marker.
+int qoi_end(void)
+{
+    unsigned char end[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+    if(qoi_run > 0) fputc(0xc0 | (qoi_run - 1), outputfp);
+    fwrite(end, 1, 8, outputfp);
+    return output_end();
+}
+
+//This function updates a png crc with the given bytes.
+unsigned int crc32_update(unsigned int crc, unsigned char* data, size_t length)
+{
+    static unsigned int table[256];
+    static int ready = 0;
+    size_t i;
+    if(!ready)
+    {
+        unsigned int n, k;
+        for(n = 0; n < 256; n++)
+        {
+            unsigned int c = n;
+            for(k = 0; k < 8; k++) c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            table[n] = c;
+        }
+        ready = 1;
+    }
+    crc = ~crc;
+    for(i = 0; i < length; i++) crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+//This function writes a png chunk of the given type and data to the output file.
+void png_chunk(char* type, unsigned char* data, unsigned int length)
+{
+    unsigned char word[4];
+    put_be32(word, length);
+    fwrite(word, 1, 4, outputfp);
+    fwrite(type, 1, 4, outputfp);
+    if(length > 0) fwrite(data, 1, length, outputfp); //IEND has no data, and fwrite() must not be given NULL
+    unsigned int crc = crc32_update(0, (unsigned char*)type, 4);
+    crc = crc32_update(crc, data, length);
+    put_be32(word, crc);
+    fwrite(word, 1, 4, outputfp);
+}
+
+//This function appends a byte to the compressed png data, sending it out as an IDAT chunk when the block is full.
+void png_byte(unsigned char b)
+{
+    png.idat[png.idatLength++] = b;
+    if(png.idatLength == OUTPUT_BLOCK)
+    {
+        png_chunk("IDAT", png.idat, png.idatLength);
+        png.idatLength = 0;
+    }
+}
+
+//This function appends the low count bits of value to the deflate stream, least significant bit first.
+void deflate_bits(unsigned int value, int count)
+{
+    png.bits |= (unsigned long long)value << png.bitCount;
+    png.bitCount += count;
+    while(png.bitCount >= 8)
+    {
+        png_byte((unsigned char)png.bits);
+        png.bits >>= 8;
+        png.bitCount -= 8;
+    }
+}
+
+//This function writes a symbol of the fixed deflate literal/length alphabet.  Huffman codes are stored
+//most significant bit first, so the code's bits are reversed before they are appended.
+void deflate_symbol(int symbol)
+{
+    unsigned int code;
+    int count;
+    if(symbol < 144)
+    {
+        code = 0x30 + symbol;
+        count = 8;
+    }
+    else if(symbol < 256)
+    {
+        code = 0x190 + symbol - 144;
+        count = 9;
+    }
+    else if(symbol < 280)
+    {
+        code = symbol - 256;
+        count = 7;
+    }
+    else
+    {
+        code = 0xc0 + symbol - 280;
+        count = 8;
+    }
+    unsigned int reversed = 0;
     int i;
-    for(i = 0; i < pwidth*pheight; i++)   //write each pixel in the image to the output file
+    for(i = 0; i < count; i++) reversed |= ((code >> i) & 1) << (count - 1 - i);
+    deflate_bits(reversed, count);
+}
+
+//This function writes a back reference of the given length and distance to the deflate stream.
+void deflate_match(int length, int distance)
+{
+    static const int lengthBase[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                       35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+                                      };
+    static const int lengthExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                        3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+                                       };
+    static const int distanceBase[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+                                         257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+                                        };
+    static const int distanceExtra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+                                          7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+                                         };
+    int i = 28;
+    while(lengthBase[i] > length) i--;
+    deflate_symbol(257 + i);
+    deflate_bits(length - lengthBase[i], lengthExtra[i]);
+    int d = 29;
+    while(distanceBase[d] > distance) d--;
+    unsigned int reversed = 0;
+    int k;
+    for(k = 0; k < 5; k++) reversed |= ((d >> k) & 1) << (4 - k);
+    deflate_bits(reversed, 5);
+    deflate_bits(distance - distanceBase[d], distanceExtra[d]);
+}
+
+//This function compresses the bytes of the history buffer that haven't been compressed yet.  It looks each
+//position up in a hash table of the last place its next three bytes were seen and greedily takes that match
+//if it is at least three bytes long.  Unless final is set, the last two bytes wait for the next row so
+//that matches can run across rows.
+void deflate_pending(int final)
+{
+    unsigned char* h = png.history;
+    int end = final ? png.length : png.length - 2;
+    while(png.position < end)
     {
-        fprintf(outputfp, "%d\n%d\n%d\n", image[i*sizeof(Pixel)].r, //in ascii
-                image[i*sizeof(Pixel)].g,
-                image[i*sizeof(Pixel)].b);
+        int p = png.position;
+        int length = 0;
+        int distance = 0;
+        if(p + 3 <= png.length)
+        {
+            unsigned int key = ((h[p] << 16) | (h[p+1] << 8) | h[p+2]) * 2654435761u >> (32 - DEFLATE_HASH_BITS);
+            long long candidate = png.head[key];
+            png.head[key] = png.base + p;
+            if(candidate >= png.base && png.base + p - candidate <= DEFLATE_WINDOW)
+            {
+                int c = (int)(candidate - png.base);
+                int most = png.length - p < 258 ? png.length - p : 258;
+                while(length < most && h[c+length] == h[p+length]) length++;
+                distance = p - c;
+            }
+        }
+        if(length >= 3)
+        {
+            deflate_match(length, distance);
+            png.position += length;
+        }
+        else
+        {
+            deflate_symbol(h[p]);
+            png.position += 1;
+        }
     }
-    return 1;
 }
 
-// next_c() wraps the getc() function and provides error checking and line
+//This function writes the png signature and header and starts a single fixed huffman deflate block.
+void png_begin(void)
+{
+    unsigned char signature[8] = {137, 'P', 'N', 'G', '\r', '\n', 26, '\n'};
+    unsigned char header[13];
+    fwrite(signature, 1, 8, outputfp);
+    put_be32(&header[0], pwidth);
+    put_be32(&header[4], pheight);
+    header[8] = 8;  //bits per channel
+    header[9] = 2;  //rgb
+    header[10] = 0; //deflate
+    header[11] = 0; //adaptive filtering
+    header[12] = 0; //not interlaced
+    png_chunk("IHDR", header, 13);
+
+    int rowLength = pwidth*3 + 1;
+    png.capacity = 2*DEFLATE_WINDOW + rowLength;
+    png.history = malloc(png.capacity);
+    png.head = malloc(sizeof(long long)*(1 << DEFLATE_HASH_BITS));
+    int i;
+    for(i = 0; i < (1 << DEFLATE_HASH_BITS); i++) png.head[i] = -1;
+    png.idat = malloc(OUTPUT_BLOCK);
+    png.idatLength = 0;
+    png.length = 0;
+    png.position = 0;
+    png.base = 0;
+    png.bits = 0;
+    png.bitCount = 0;
+    png.adlerA = 1;
+    png.adlerB = 0;
+    png_byte(0x78); //zlib header: deflate with a 32k window, fastest compression
+    png_byte(0x01);
+    deflate_bits(1, 1); //final block
+    deflate_bits(1, 2); //fixed huffman codes
+}
+
+//This function filters one row of the pixel buffer with the png sub filter and compresses it.
+void png_row(Pixel* row, float* hdr, int y)
+{
+    int rowLength = pwidth*3 + 1;
+    if(png.length + rowLength > png.capacity) //slide the history so that only the last window is kept
+    {
+        int shift = png.position - DEFLATE_WINDOW;
+        memmove(png.history, png.history + shift, png.length - shift);
+        png.length -= shift;
+        png.position -= shift;
+        png.base += shift;
+    }
+    unsigned char* out = &png.history[png.length];
+    out[0] = 1; //sub filter: each byte is stored as the difference from the same channel of the pixel to its left
+    int x;
+    for(x = 0; x < pwidth; x++)
+    {
+        Pixel px = row[x];
+        Pixel left = {0, 0, 0};
+        if(x > 0) left = row[x-1];
+        out[1 + x*3] = (unsigned char)(px.r - left.r);
+        out[2 + x*3] = (unsigned char)(px.g - left.g);
+        out[3 + x*3] = (unsigned char)(px.b - left.b);
+    }
+    for(x = 0; x < rowLength; x++)
+    {
+        png.adlerA = (png.adlerA + out[x]) % 65521;
+        png.adlerB = (png.adlerB + png.adlerA) % 65521;
+    }
+    png.length += rowLength;
+    deflate_pending(0);
+}
+
+//This function ends the deflate block, writes the zlib checksum, and writes the last IDAT chunk and the IEND chunk.
+int png_end(void)
+{
+    deflate_pending(1);
+    deflate_symbol(256); //end of block
+    if(png.bitCount > 0) deflate_bits(0, 8 - png.bitCount);
+    png_byte((unsigned char)(png.adlerB >> 8));
+    png_byte((unsigned char)png.adlerB);
+    png_byte((unsigned char)(png.adlerA >> 8));
+    png_byte((unsigned char)png.adlerA);
+    if(png.idatLength > 0) png_chunk("IDAT", png.idat, png.idatLength);
+    png_chunk("IEND", NULL, 0);
+    free(png.history);
+    free(png.head);
+    free(png.idat);
+    return output_end();
+}
+
+OutputFormat output_formats[] =
+{
+    {"p6", ".ppm", 0, p6_begin, p6_row, output_end},
+    {"p3", "", 0, p3_begin, p3_row, output_end},
+    {"pfm", ".pfm", 1, pfm_begin, pfm_row, output_end},
+    {"qoi", ".qoi", 0, qoi_begin, qoi_row, qoi_end},
+    {"png", ".png", 0, png_begin, png_row, png_end},
+};
+
+//This function finds the output format with the given --format name, or the one whose extension the
+//output filename ends with when name is NULL.  Files with any other extension are written as p6.
+//It returns NULL if the name is unknown.
+OutputFormat* find_output_format(char* name, char* filename)
+{
+    int count = sizeof(output_formats)/sizeof(OutputFormat);
+    int i;
+    for(i = 0; i < count; i++)
+    {
+        if(name != NULL && strcmp(name, output_formats[i].name) == 0) return &output_formats[i];
+    }
+    if(name != NULL) return NULL;
+    char* extension = strrchr(filename, '.');
+    for(i = 0; extension != NULL && i < count; i++)
+    {
+        if(strcmp(extension, output_formats[i].extension) == 0) return &output_formats[i];
+    }
+    return &output_formats[0];
+}
+
+//This function writes data from the pixel buffer passed into the function to the output file in the selected
+//format, handing the rows to the writer from the top of the image down.  hdr holds the unclamped colors and is
+//only needed by floating point formats.
+int write_image(Pixel* image, float* hdr)
+{
+    int y;
+    output_format->begin();
+    for(y = 0; y < pheight; y++)
+    {
+        output_format->row(&image[y*pwidth], hdr != NULL ? &hdr[y*pwidth*3] : NULL, y);
+    }
+    return output_format->end();
+}
+
+// next_c() reads the next character of the mapped scene file and provides error checking and line
 // number maintenance
-int next_c(FILE* json)
+int next_c(SceneFile* json)
 {
-    int c = fgetc(json);
+    if (json->position >= json->length)
+    {
+        fprintf(stderr, "Error: Unexpected end of file on line number %d.\n", line);
+        exit(1);
+    }
+    int c = (unsigned char)json->data[json->position++];
 #ifdef DEBUG
     printf("next_c: '%c'\n", c);
 #endif
@@ -145,18 +969,19 @@ int next_c(FILE* json)
     {
         line += 1;
     }
-    if (c == EOF)
-    {
-        fprintf(stderr, "Error: Unexpected end of file on line number %d.\n", line);
-        exit(1);
-    }
     return c;
 }
 
+// unget_c() steps back over the last character read, which is never a newline.
+void unget_c(SceneFile* json)
+{
+    json->position -= 1;
+}
+
 
 // expect_c() checks that the next character is d.  If it is not it emits
 // an error.
-void expect_c(FILE* json, int d)
+void expect_c(SceneFile* json, int d)
 {
     int c = next_c(json);
     if (c == d) return;
@@ -166,28 +991,30 @@ void expect_c(FILE* json, int d)
 
 
 // skip_ws() skips white space in the file.
-void skip_ws(FILE* json)
+void skip_ws(SceneFile* json)
 {
     int c = next_c(json);
     while (isspace(c))
     {
         c = next_c(json);
     }
-    ungetc(c, json);
+    unget_c(json);
 }
 
 
-// next_string() gets the next string from the file handle and emits an error
-// if a string can not be obtained.
-char* next_string(FILE* json)
+// next_string() gets the next string from the file and emits an error
+// if a string can not be obtained.  The string is not copied, the returned
+// JsonString points at its characters inside the mapped file.
+JsonString next_string(SceneFile* json)
 {
-    char buffer[129];
+    JsonString s;
     int c = next_c(json);
     if (c != '"')
     {
         fprintf(stderr, "Error: Expected string on line %d.\n", line);
         exit(1);
     }
+    s.start = json->data + json->position;
     c = next_c(json);
     int i = 0;
     while (c != '"')
@@ -207,64 +1034,201 @@ char* next_string(FILE* json)
             fprintf(stderr, "Error: Strings may contain only ascii characters.\n");
             exit(1);
         }
-        buffer[i] = c;
         i += 1;
         c = next_c(json);
     }
-    buffer[i] = 0;
-    char* returnString = malloc(sizeof(buffer));
-    strcpy(returnString, buffer);
-    return returnString;
-}
-
-//This function reads the next number in the input json file and returns that number
-//if it was indeed a number.  If a number was not found, it exits the program with an error.
-double next_number(FILE* json)
-{
-    double value;
-    int f = fscanf(json, "%lf", &value);
-    if (f == 1) return value;
-    fprintf(stderr, "Error: Expected number on line %d.\n", line);
-    exit(1);
+    s.length = i;
+    return s;
 }
 
-//this function reads a three dimensional vector from the input json file.
-//Its error handling is inside the expect_c and next_number functions.
-//It expects a three dimensional vector which is bookended by brackets where
-//each value of the vector is a number and each number is separated by a comma.
-double* next_vector(FILE* json)
+// json_eq() checks whether a string from the file is the given literal.
+int json_eq(JsonString s, char* literal)
 {
-    double* v = malloc(3*sizeof(double));
-    expect_c(json, '[');
-    skip_ws(json);
-    v[0] = next_number(json);
-    skip_ws(json);
-    expect_c(json, ',');
-    skip_ws(json);
-    v[1] = next_number(json);
-    skip_ws(json);
-    expect_c(json, ',');
-    skip_ws(json);
-    v[2] = next_number(json);
-    skip_ws(json);
-    expect_c(json, ']');
-    return v;
+    return (int)strlen(literal) == s.length && strncmp(s.start, literal, s.length) == 0;
 }
 
-//this function takes in a json file and memory to store objects from the file.
-//After successfully parsing the json file, it will have stored all objects in
-//the json file into the memory passed into the function and will return the
-//number of objects it found.
-int* read_scene(char* filename, Object* objects, Light* lights)
+//This function reads the next number in the input json file and returns that number
+//if it was indeed a number.  If a number was not found, it exits the program with an error.
+//The digits are read straight out of the mapped file.  Numbers with at most 19 significant digits
+//and a small power of ten are exact as a double times or divided by an exact power of ten,
+//so they are converted directly; anything else is handed to strtod() to be rounded correctly.
+double next_number(SceneFile* json)
 {
-    int c;
-    FILE* json = fopen(filename, "r");
+    static const double powers[23] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                      1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+                                     };
+    char* start = json->data + json->position;
+    char* end = json->data + json->length;
+    char* p = start;
+    int negative = 0;
+    unsigned long long mantissa = 0;
+    int significant = 0; //digits kept in the mantissa
+    int truncated = 0;   //whether any nonzero digit didn't fit in the mantissa
+    int exponent = 0;    //power of ten the mantissa is scaled by
+    int digits = 0;      //digits seen at all
 
-    if (json == NULL)
+    if (p < end && (*p == '-' || *p == '+'))
     {
-        fprintf(stderr, "Error: Could not open file \"%s\"\n", filename);
+        negative = *p == '-';
+        p++;
+    }
+    while (p < end && isdigit((unsigned char)*p))
+    {
+        if (significant < 19)
+        {
+            mantissa = mantissa*10 + (*p - '0');
+            if (mantissa != 0) significant++;
+        }
+        else
+        {
+            exponent++;
+            if (*p != '0') truncated = 1;
+        }
+        p++;
+        digits++;
+    }
+    if (p < end && *p == '.')
+    {
+        p++;
+        while (p < end && isdigit((unsigned char)*p))
+        {
+            if (significant < 19)
+            {
+                mantissa = mantissa*10 + (*p - '0');
+                if (mantissa != 0) significant++;
+                exponent--;
+            }
+            else if (*p != '0') truncated = 1;
+            p++;
+            digits++;
+        }
+    }
+    if (digits == 0)
+    {
+        fprintf(stderr, "Error: Expected number on line %d.\n", line);
+        exit(1);
+    }
+    if (p < end && (*p == 'e' || *p == 'E'))
+    {
+        char* q = p + 1;
+        int negativeExponent = 0;
+        int e = 0;
+        if (q < end && (*q == '-' || *q == '+'))
+        {
+            negativeExponent = *q == '-';
+            q++;
+        }
+        if (q < end && isdigit((unsigned char)*q)) //an exponent needs at least one digit, otherwise the e isn't part of the number
+        {
+            while (q < end && isdigit((unsigned char)*q))
+            {
+                if (e < 100000) e = e*10 + (*q - '0');
+                q++;
+            }
+            exponent += negativeExponent ? -e : e;
+            p = q;
+        }
+    }
+    json->position = p - json->data;
+
+    double value;
+    if (!truncated && mantissa <= (1ULL << 53) && exponent >= -22 && exponent <= 22)
+    {
+        value = (double)mantissa;
+        if (exponent < 0) value /= powers[-exponent];
+        else value *= powers[exponent];
+        return negative ? -value : value;
+    }
+    //slow path for long or very large or small numbers
+    char buffer[512];
+    char* copy = buffer;
+    if (p - start >= (long)sizeof(buffer)) copy = malloc(p - start + 1);
+    memcpy(copy, start, p - start);
+    copy[p - start] = 0;
+    value = strtod(copy, NULL);
+    if (copy != buffer) free(copy);
+    return value;
+}
+
+//this function reads a three dimensional vector from the input json file into v.
+//Its error handling is inside the expect_c and next_number functions.
+//It expects a three dimensional vector which is bookended by brackets where
+//each value of the vector is a number and each number is separated by a comma.
+void next_vector(SceneFile* json, Real* v)
+{
+    expect_c(json, '[');
+    skip_ws(json);
+    v[0] = next_number(json);
+    skip_ws(json);
+    expect_c(json, ',');
+    skip_ws(json);
+    v[1] = next_number(json);
+    skip_ws(json);
+    expect_c(json, ',');
+    skip_ws(json);
+    v[2] = next_number(json);
+    skip_ws(json);
+    expect_c(json, ']');
+}
+
+//this function makes room for one more element at the end of a growable array holding count elements,
+//doubling its capacity whenever it is full, and returns the possibly moved array
+void* grow_array(void* array, int count, int* capacity, size_t size)
+{
+    if (count < *capacity) return array;
+    *capacity = *capacity > 0 ? *capacity * 2 : 16;
+    array = realloc(array, size * (*capacity));
+    if (array == NULL)
+    {
+        fprintf(stderr, "Error: Out of memory after %d scene entries.\n", count);
+        exit(1);
+    }
+    return array;
+}
+
+//this function maps the named file into memory so that it can be tokenized where it lies, and starts counting
+//lines from 1.  If the file can't be opened it exits the program with an error.
+void map_file(char* filename, SceneFile* file)
+{
+    int fd = open(filename, O_RDONLY);
+    struct stat info;
+
+    if (fd == -1 || fstat(fd, &info) == -1)
+    {
+        fprintf(stderr, "Error: Could not open file \"%s\"\n", filename);
         exit(1);
     }
+    file->length = info.st_size;
+    file->position = 0;
+    file->data = NULL;
+    if (file->length > 0)
+    {
+        file->data = mmap(NULL, file->length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (file->data == MAP_FAILED)
+        {
+            fprintf(stderr, "Error: Could not open file \"%s\"\n", filename);
+            exit(1);
+        }
+        madvise(file->data, file->length, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    line = 1;
+}
+
+//this function takes in a json file and a scene to store the objects and lights from the file in.
+//After successfully parsing the json file, it will have stored all objects and lights in
+//the json file into arrays that grow as they fill, trimmed to size at the end, and will
+//return 1.  It returns -1 if the file contains no objects.
+int read_scene(char* filename, Scene* scene)
+{
+    int c;
+    int objectCapacity = 0;
+    int lightCapacity = 0;
+    Object* objects = NULL;
+    Light* lights = NULL;
+    SceneFile file;
+    SceneFile* json = &file;
+    map_file(filename, json); //map the whole file so that it can be tokenized where it lies
 
     skip_ws(json);
     // Find the beginning of the list
@@ -272,16 +1236,16 @@ int* read_scene(char* filename, Object* objects, Light* lights)
     skip_ws(json);
     // Find the objects
     expect_c(json, '{');
-    ungetc('{', json);
+    unget_c(json);
     int i = 0;
     int j = 0;
     while (1)
     {
-        c = fgetc(json);
+        c = next_c(json);
         if (c == ']')          //if the list is empty, the file contains no objects
         {
             fprintf(stderr, "Error: Scene file contains no objects.\n");
-            fclose(json);
+            munmap(file.data, file.length);
             return -1;
         }
         if (c == '{')         //if an object is found
@@ -294,12 +1258,13 @@ int* read_scene(char* filename, Object* objects, Light* lights)
             temp.sphere.reflectivity = 0;
             temp.sphere.refractivity = 0;
             temp.sphere.ior = 1;
+            templight.kind = 0; //lights are radial unless a spotlight property is found
 
             int obj_or_light = 0;
 
             // Parse the object
-            char* key = next_string(json);
-            if (strcmp(key, "type") != 0) //object type is the first key of an object expected
+            JsonString key = next_string(json);
+            if (!json_eq(key, "type")) //object type is the first key of an object expected
             {
                 fprintf(stderr, "Error: Expected \"type\" key on line number %d.\n", line);
                 exit(1);
@@ -308,27 +1273,27 @@ int* read_scene(char* filename, Object* objects, Light* lights)
             skip_ws(json);
             expect_c(json, ':');        //colon separates key from value in each key-value pair
             skip_ws(json);
-            char* value = next_string(json);
+            JsonString value = next_string(json);
 
-            if (strcmp(value, "camera") == 0)
+            if (json_eq(value, "camera"))
             {
                 temp.kind = 0;         //remember that this object is a camera in the temporary Object
             }
-            else if (strcmp(value, "sphere") == 0)
+            else if (json_eq(value, "sphere"))
             {
                 temp.kind = 1;         //remember that this object is a sphere in the temporary Object
             }
-            else if (strcmp(value, "plane") == 0)
+            else if (json_eq(value, "plane"))
             {
                 temp.kind = 2;         //remember that this object is a plane in the temporary Object
             }
-            else if (strcmp(value, "light") == 0)
+            else if (json_eq(value, "light"))
             {
                 obj_or_light = 1;     //remember that a light was found
             }
             else                       //if a non-camera/sphere/plane/light was found as the the type, print an error message and exit
             {
-                fprintf(stderr, "Error: Unknown type, \"%s\", on line number %d.\n", value, line);
+                fprintf(stderr, "Error: Unknown type, \"%.*s\", on line number %d.\n", value.length, value.start, line);
                 exit(1);
             }
 
@@ -364,26 +1329,26 @@ int* read_scene(char* filename, Object* objects, Light* lights)
                 {
                     // read another field
                     skip_ws(json);
-                    char* key = next_string(json); //get the key of the property
+                    JsonString key = next_string(json); //get the key of the property
                     skip_ws(json);
                     expect_c(json, ':');           //key-value pair is separated by a colon
                     skip_ws(json);
-                    if ((strcmp(key, "width") == 0) ||    //if the key denotes a decimal number
-                            (strcmp(key, "height") == 0) ||
-                            (strcmp(key, "radius") == 0) ||
-                            (strcmp(key, "radial-a2") == 0) ||
-                            (strcmp(key, "radial-a1") == 0) ||
-                            (strcmp(key, "radial-a0") == 0) ||
-                            (strcmp(key, "angular-a0") == 0) ||
-                            (strcmp(key, "theta") == 0) ||
-                            (strcmp(key, "reflectivity") == 0) ||
-                            (strcmp(key, "refractivity") == 0) ||
-                            (strcmp(key, "ior") == 0))
+                    if ((json_eq(key, "width")) ||    //if the key denotes a decimal number
+                            (json_eq(key, "height")) ||
+                            (json_eq(key, "radius")) ||
+                            (json_eq(key, "radial-a2")) ||
+                            (json_eq(key, "radial-a1")) ||
+                            (json_eq(key, "radial-a0")) ||
+                            (json_eq(key, "angular-a0")) ||
+                            (json_eq(key, "theta")) ||
+                            (json_eq(key, "reflectivity")) ||
+                            (json_eq(key, "refractivity")) ||
+                            (json_eq(key, "ior")))
                     {
                         double value = next_number(json); //get the decimal number and store it in the relevant struct field
                         if(obj_or_light == 1)
                         {
-                            if((strcmp(key, "radial-a2") == 0))
+                            if((json_eq(key, "radial-a2")))
                             {
                                 if(value < 0)
                                 {
@@ -393,7 +1358,7 @@ int* read_scene(char* filename, Object* objects, Light* lights)
                                 templight.radial_a2 = value;
                                 ra2_attribute_counter++;
                             }
-                            else if((strcmp(key, "radial-a1") == 0))
+                            else if((json_eq(key, "radial-a1")))
                             {
                                 if(value < 0)
                                 {
@@ -403,7 +1368,7 @@ int* read_scene(char* filename, Object* objects, Light* lights)
                                 templight.radial_a1 = value;
                                 ra1_attribute_counter++;
                             }
-                            else if((strcmp(key, "radial-a0") == 0))
+                            else if((json_eq(key, "radial-a0")))
                             {
                                 if(value < 0)
                                 {
@@ -413,7 +1378,7 @@ int* read_scene(char* filename, Object* objects, Light* lights)
                                 templight.radial_a0 = value;
                                 ra0_attribute_counter++;
                             }
-                            else if((strcmp(key, "angular-a0") == 0))
+                            else if((json_eq(key, "angular-a0")))
                             {
                                 if(value < 0)
                                 {
@@ -424,7 +1389,7 @@ int* read_scene(char* filename, Object* objects, Light* lights)
                                 templight.spotlight.angular_a0 = value;
                                 aa0_attribute_counter++;
                             }
-                            else if((strcmp(key, "theta") == 0))
+                            else if((json_eq(key, "theta")))
                             {
                                 if(value != 0) templight.kind = 1;
                                 templight.theta = value;
@@ -432,25 +1397,25 @@ int* read_scene(char* filename, Object* objects, Light* lights)
                             }
                             else
                             {
-                                fprintf(stderr, "Error: Unknown property, \"%s\", on line number %d.\n", key, line);
+                                fprintf(stderr, "Error: Unknown property, \"%.*s\", on line number %d.\n", key.length, key.start, line);
                                 exit(1);
                             }
                         }
                         else if(temp.kind == 0)
                         {
-                            if((strcmp(key, "width") == 0))
+                            if((json_eq(key, "width")))
                             {
                                 temp.camera.width = value;
                                 w_attribute_counter++;
                             }
-                            else if(strcmp(key, "height") == 0)
+                            else if(json_eq(key, "height"))
                             {
                                 temp.camera.height = value;
                                 h_attribute_counter++;
                             }
                             else
                             {
-                                fprintf(stderr, "Error: Camera object has unexpected attribute '%s' on line number %d.\n", key, line);
+                                fprintf(stderr, "Error: Camera object has unexpected attribute '%.*s' on line number %d.\n", key.length, key.start, line);
                                 exit(1);
                             }
                             //default camera position
@@ -458,7 +1423,7 @@ int* read_scene(char* filename, Object* objects, Light* lights)
                             temp.camera.center[1] = 0.0;
                             temp.camera.center[2] = 0.0;
                         }
-                        else if(temp.kind == 1 && (strcmp(key, "radius") == 0))
+                        else if(temp.kind == 1 && (json_eq(key, "radius")))
                         {
                             temp.sphere.radius = value;
                             r_attribute_counter++;
@@ -470,65 +1435,66 @@ int* read_scene(char* filename, Object* objects, Light* lights)
                         }
                         else if(temp.kind == 1)
                         {
-                            if((strcmp(key, "reflectivity") == 0))
+                            if((json_eq(key, "reflectivity")))
                             {
                                 temp.sphere.reflectivity = value;
                                 //w_attribute_counter++;
                             }
-                            else if((strcmp(key, "refractivity") == 0))
+                            else if((json_eq(key, "refractivity")))
                             {
                                 temp.sphere.refractivity = value;
                                 //w_attribute_counter++;
                             }
-                            else if((strcmp(key, "ior") == 0))
+                            else if((json_eq(key, "ior")))
                             {
                                 temp.sphere.ior = value;
                                 //w_attribute_counter++;
                             }
                             else
                             {
-                                fprintf(stderr, "Error: Unexpected sphere attribute %s on line %d.\n", key, line);
+                                fprintf(stderr, "Error: Unexpected sphere attribute %.*s on line %d.\n", key.length, key.start, line);
                                 exit(1);
                             }
                         }
                         else if(temp.kind == 2)
                         {
-                            if((strcmp(key, "reflectivity") == 0))
+                            if((json_eq(key, "reflectivity")))
                             {
                                 temp.sphere.reflectivity = value;
                                 //w_attribute_counter++;
                             }
-                            else if((strcmp(key, "refractivity") == 0))
+                            else if((json_eq(key, "refractivity")))
                             {
                                 temp.sphere.refractivity = value;
                                 //w_attribute_counter++;
                             }
-                            else if((strcmp(key, "ior") == 0))
+                            else if((json_eq(key, "ior")))
                             {
                                 temp.sphere.ior = value;
                                 //w_attribute_counter++;
                             }
                             else
                             {
-                                fprintf(stderr, "Error: Unexpected plane attribute %s on line %d.\n", key, line);
+                                fprintf(stderr, "Error: Unexpected plane attribute %.*s on line %d.\n", key.length, key.start, line);
                                 exit(1);
                             }
                         }
                         else
                         {
-                            fprintf(stderr, "Error: Unexpected attribute '%s' on line number %d.\n", key, line);
+                            fprintf(stderr, "Error: Unexpected attribute '%.*s' on line number %d.\n", key.length, key.start, line);
                             exit(1);
                         }
                     }
-                    else if ((strcmp(key, "diffuse_color") == 0) || //if the key denotes a vector
-                             (strcmp(key, "specular_color") == 0) ||
-                             (strcmp(key, "position") == 0) ||
-                             (strcmp(key, "normal") == 0) ||
-                             (strcmp(key, "color") == 0) ||
-                             (strcmp(key, "direction") == 0))
+                    else if ((json_eq(key, "diffuse_color")) || //if the key denotes a vector
+                             (json_eq(key, "specular_color")) ||
+                             (json_eq(key, "position")) ||
+                             (json_eq(key, "normal")) ||
+                             (json_eq(key, "color")) ||
+                             (json_eq(key, "direction")))
                     {
-                        double* value = next_vector(json); //get the vector and store it in the relevant struct field
-                        if(strcmp(key, "diffuse_color") == 0)
+                        Real value[3];
+                        next_vector(json, value); //get the vector and store it in the relevant struct field
+                        if(json_eq(key, "diffuse_color"))
                         {
                             if(value[0] > 1 || value[0] < 0 || //color values must be between 0 and 1
                                     value[1] > 1 || value[1] < 0 || //an error is printed and and the program exits otherwise.
@@ -540,21 +1506,21 @@ int* read_scene(char* filename, Object* objects, Light* lights)
                         }
                         if(obj_or_light == 1) //if the current thing being parsed is a light
                         {
-                            if((strcmp(key, "color") == 0))
+                            if((json_eq(key, "color")))
                             {
                                 templight.color[0] = value[0];
                                 templight.color[1] = value[1];
                                 templight.color[2] = value[2];
                                 c_attribute_counter++;
                             }
-                            else if((strcmp(key, "position") == 0))
+                            else if((json_eq(key, "position")))
                             {
                                 templight.position[0] = value[0];
                                 templight.position[1] = value[1];
                                 templight.position[2] = value[2];
                                 p_attribute_counter++;
                             }
-                            else if((strcmp(key, "direction") == 0))
+                            else if((json_eq(key, "direction")))
                             {
                                 templight.kind = 1;
                                 templight.spotlight.direction[0] = value[0];
@@ -564,11 +1530,11 @@ int* read_scene(char* filename, Object* objects, Light* lights)
                             }
                             else
                             {
-                                fprintf(stderr, "Error: Unknown property, \"%s\", on line number %d.\n", key, line);
+                                fprintf(stderr, "Error: Unknown property, \"%.*s\", on line number %d.\n", key.length, key.start, line);
                                 exit(1);
                             }
                         }
-                        else if (temp.kind == 0 && (strcmp(key, "position") == 0))
+                        else if (temp.kind == 0 && (json_eq(key, "position")))
                         {
                             temp.camera.center[0] = value[0];
                             temp.camera.center[1] = value[1];
@@ -577,21 +1543,21 @@ int* read_scene(char* filename, Object* objects, Light* lights)
                         }
                         else if(temp.kind == 1)
                         {
-                            if(strcmp(key, "diffuse_color") == 0)
+                            if(json_eq(key, "diffuse_color"))
                             {
                                 temp.diffuse_color[0] = value[0];
                                 temp.diffuse_color[1] = value[1];
                                 temp.diffuse_color[2] = value[2];
                                 dc_attribute_counter++;
                             }
-                            else if(strcmp(key, "specular_color") == 0)
+                            else if(json_eq(key, "specular_color"))
                             {
                                 temp.specular_color[0] = value[0];
                                 temp.specular_color[1] = value[1];
                                 temp.specular_color[2] = value[2];
                                 sc_attribute_counter++;
                             }
-                            else if(strcmp(key, "position") == 0)
+                            else if(json_eq(key, "position"))
                             {
                                 temp.sphere.center[0] = value[0];
                                 temp.sphere.center[1] = value[1];
@@ -600,35 +1566,40 @@ int* read_scene(char* filename, Object* objects, Light* lights)
                             }
                             else
                             {
-                                fprintf(stderr, "Error: Unknown property, \"%s\", on line number %d.\n", key, line);
+                                fprintf(stderr, "Error: Unknown property, \"%.*s\", on line number %d.\n", key.length, key.start, line);
                                 exit(1);
                             }
                         }
                         else if(temp.kind == 2)
                         {
-                            if(strcmp(key, "diffuse_color") == 0)
+                            if(json_eq(key, "diffuse_color"))
                             {
                                 temp.diffuse_color[0] = value[0];
                                 temp.diffuse_color[1] = value[1];
                                 temp.diffuse_color[2] = value[2];
                                 dc_attribute_counter++;
                             }
-                            else if(strcmp(key, "specular_color") == 0)
+                            else if(json_eq(key, "specular_color"))
                             {
                                 temp.specular_color[0] = value[0];
                                 temp.specular_color[1] = value[1];
                                 temp.specular_color[2] = value[2];
                                 sc_attribute_counter++;
                             }
-                            else if(temp.kind == 2 && (strcmp(key, "position") == 0))
+                            else if(temp.kind == 2 && (json_eq(key, "position")))
                             {
                                 temp.plane.center[0] = value[0];
-                                temp.plane.center[1] = -value[1];
+                                temp.plane.center[1] = value[1];
                                 temp.plane.center[2] = value[2];
                                 p_attribute_counter++;
                             }
-                            else if(temp.kind == 2 && (strcmp(key, "normal") == 0))
+                            else if(temp.kind == 2 && (json_eq(key, "normal")))
                             {
+                                if(value[0] == 0 && value[1] == 0 && value[2] == 0) //a plane needs a direction to face
+                                {
+                                    fprintf(stderr, "Error: Plane normal cannot be a zero vector on line %d.\n", line);
+                                    exit(1);
+                                }
                                 temp.plane.normal[0] = value[0];
                                 temp.plane.normal[1] = value[1];
                                 temp.plane.normal[2] = value[2];
@@ -636,7 +1607,7 @@ int* read_scene(char* filename, Object* objects, Light* lights)
                             }
                             else
                             {
-                                fprintf(stderr, "Error: Unknown property, \"%s\", on line number %d.\n", key, line);
+                                fprintf(stderr, "Error: Unknown property, \"%.*s\", on line number %d.\n", key.length, key.start, line);
                                 exit(1);
                             }
                         }
@@ -661,9 +1632,9 @@ int* read_scene(char* filename, Object* objects, Light* lights)
                     }
                     else //if the input property is unknown, tell the user that property is unknown and exit
                     {
-                        fprintf(stderr, "Error: Unknown property, \"%s\", on line %d.\n",
-                                key, line);
-                        //char* value = next_string(json);
+                        fprintf(stderr, "Error: Unknown property, \"%.*s\", on line %d.\n",
+                                key.length, key.start, line);
+                        //JsonString value = next_string(json);
                     }
                     skip_ws(json);
                 }
@@ -715,12 +1686,14 @@ int* read_scene(char* filename, Object* objects, Light* lights)
             //if the current thing being parsed is not a light, store it object data
             if(obj_or_light == 0)
             {
-                *(objects+i*sizeof(Object)) = temp; //allocate the temporary object into a struct of objects at its corresponding position
+                objects = grow_array(objects, i, &objectCapacity, sizeof(Object));
+                objects[i] = temp; //store the temporary object into the array of objects at its corresponding position
                 i++; //and increment the index of the current object for the memory that holds the object structs
             }
             else //otherwise store it in light data
             {
-                *(lights+j*sizeof(Light)) = templight; //allocate the temporary light into a struct of lights at its corresponding position
+                lights = grow_array(lights, j, &lightCapacity, sizeof(Light));
+                lights[j] = templight; //store the temporary light into the array of lights at its corresponding position
                 j++; //and increment the index of the current light for the memory that holds the light structs
             }
 
@@ -735,15 +1708,16 @@ int* read_scene(char* filename, Object* objects, Light* lights)
                     fprintf(stderr, "Error: Expecting '{' on line %d.\n", line);
                     exit(1);
                 }
-                ungetc(d, json); //if the next char was a curly brace, unget it
+                unget_c(json); //if the next char was a curly brace, unget it
             }
-            else if (c == ']') //if there are no more objects to be parsed, close the file and return the number of objects
+            else if (c == ']') //if there are no more objects to be parsed, unmap the file and return the number of objects
             {
-                fclose(json);
-                int* numObjLts = malloc(sizeof(int)*2);
-                numObjLts[0] = i;
-                numObjLts[1] = j;
-                return numObjLts;
+                munmap(file.data, file.length);
+                scene->objects = realloc(objects, sizeof(Object)*(i > 0 ? i : 1)); //trim the arrays to the number of entries found
+                scene->lights = realloc(lights, sizeof(Light)*(j > 0 ? j : 1));
+                scene->numOfObjects = i;
+                scene->numOfLights = j;
+                return 1;
             }
             else //if a list separator or list terminator was not found, print an error and exit
             {
@@ -754,481 +1728,3232 @@ int* read_scene(char* filename, Object* objects, Light* lights)
     }
 }
 
-//this function calculates the t-value that the input ray intersects with an object
-//based on the sphere's center position and radius that are each passed into the function.
-double sphere_intersection(double* Ro, double* Rd,
-                           double* C, double r)
-{
-    double a = (sqr(Rd[0]) + sqr(Rd[1]) + sqr(Rd[2]));
-    double b = (2 * (Ro[0] * Rd[0] - Rd[0] * C[0] + Ro[1] * Rd[1] - Rd[1] * C[1] + Ro[2] * Rd[2] - Rd[2] * C[2]));
-    double c = sqr(Ro[0]) - 2*Ro[0]*C[0] + sqr(C[0]) + sqr(Ro[1]) - 2*Ro[1]*C[1] + sqr(C[1]) + sqr(Ro[2]) - 2*Ro[2]*C[2] + sqr(C[2]) - sqr(r);
-
-    double det = sqr(b) - 4 * a * c; //use a b and c to calculate the determinant
-    if (det < 0) return -1;          //returns -1 if a number not in the viewplane was calculated
-
-    det = sqrt(det);
-
-    double t0 = (-b - det) / (2*a); //find the first t value, which is smaller
-    if (t0 > 0) return t0;          //return it if it is positive
-
-    double t1 = (-b + det) / (2*a); //find the larger second t value
-    if (t1 > 0) return t1;          //return it if it is positive
-
-    return -1;                      //return -1 if there are no positive points of intersection
-}
-
-//this function calculates the t-value of the intersection of an input ray with a plane.
-//based on the plane's center and normal values.
-double plane_intersection(double* Ro, double* Rd,
-                          double* C, double* N)
+//this function returns a null terminated copy of a string from a json file
+char* copy_string(JsonString s)
 {
-    double t, d;
-    //t = -(AX0 + BY0 + CZ0 + D) / (AXd + BYd + CZd);
-    //D = distance from the origin to the plane
-    d = sqrt(sqr(C[0]-Ro[0])+sqr(C[1]-Ro[1])+sqr(C[2]-Ro[2])); //calculate the d
-    t = -(N[0]*Ro[0] + N[1]*Ro[1] + N[2]*Ro[2] + d) / (N[0]*Rd[0] + N[1]*Rd[1] + N[2]*Rd[2]); //calculate the t where the ray intersects the plane
-    return t;
+    char* copy = malloc(s.length + 1);
+    memcpy(copy, s.start, s.length);
+    copy[s.length] = 0;
+    return copy;
 }
 
-//this function calculates the closest t-value and closest object based on the input parameters of the function
-double* shoot(double* Ro, double* Rd, double best_t, int best_object, int numOfObjects, Object* objects, int extra, int closest_extra)
+//this function reads a batch job's list of overrides.  Each override names a light or an object by its index in
+//the scene file (lights and objects are counted separately, from 0), followed by the properties to change, e.g.
+//{"light": 0, "color": [1, 0, 0]}.  The properties are checked against the scene once it has been read.
+void read_overrides(SceneFile* json, BatchJob* job)
 {
-    double t = 0;
-
-    int i;
-    for (i=0; i < numOfObjects; i += 1)
+    int capacity = 0;
+    int c;
+    expect_c(json, '[');
+    skip_ws(json);
+    c = next_c(json);
+    if (c == ']') return;
+    unget_c(json);
+    while (1)
     {
-        t = 0;
-
-        if (i == closest_extra && extra != 0) continue;
-
-        switch(objects[i*sizeof(Object)].kind)
+        expect_c(json, '{');
+        skip_ws(json);
+        JsonString key = next_string(json);
+        skip_ws(json);
+        expect_c(json, ':');
+        skip_ws(json);
+        int light = -1;
+        int object = -1;
+        if (json_eq(key, "light")) light = (int)next_number(json);
+        else if (json_eq(key, "object")) object = (int)next_number(json);
+        else //what is being changed is the first key of an override expected
         {
-        case 0: //camera has no physical intersections
-            break;
-        case 1: //if the object is a sphere, find its minimum intersection
-            t = sphere_intersection(Ro, Rd,
-                                    objects[i*sizeof(Object)].sphere.center,
-                                    objects[i*sizeof(Object)].sphere.radius);
-            break;
-        case 2: //if the object is a plane, find its point of intersection
-            t = plane_intersection(Ro, Rd,
-                                   objects[i*sizeof(Object)].plane.center,
-                                   objects[i*sizeof(Object)].plane.normal);
-            break;
-        default:
-            fprintf(stderr, "Error: Forbidden object struct type located in memory, intersection could not be calculated.\n");
+            fprintf(stderr, "Error: Expected \"light\" or \"object\" key on line number %d.\n", line);
             exit(1);
         }
-        if (t > extra && extra != 0)
+        if (light < -1 || object < -1 || (light == -1 && object == -1))
         {
-            continue;
+            fprintf(stderr, "Error: Light or object index cannot be negative on line number %d.\n", line);
+            exit(1);
+        }
+        skip_ws(json);
+        while ((c = next_c(json)) == ',') //read each property of the override
+        {
+            skip_ws(json);
+            key = next_string(json);
+            skip_ws(json);
+            expect_c(json, ':');
+            skip_ws(json);
+            job->overrides = grow_array(job->overrides, job->numOfOverrides, &capacity, sizeof(Override));
+            Override* o = &job->overrides[job->numOfOverrides++];
+            o->light = light;
+            o->object = object;
+            snprintf(o->key, sizeof(o->key), "%.*s", key.length, key.start);
+            c = next_c(json);
+            unget_c(json);
+            if (c == '[')
+            {
+                next_vector(json, o->value);
+                o->count = 3;
+            }
+            else
+            {
+                o->value[0] = next_number(json);
+                o->count = 1;
+            }
+            skip_ws(json);
+        }
+        if (c != '}')
+        {
+            fprintf(stderr, "Error: Expecting ',' or '}' on line %d.\n", line);
+            exit(1);
         }
-        if (t > 0 && t < best_t) //if an object is in front of another object, ensure the front-most object is displayed
+        skip_ws(json);
+        c = next_c(json);
+        if (c == ']') return;
+        if (c != ',')
         {
-            best_t = t;
-            best_object = i;
+            fprintf(stderr, "Error: Expecting ',' or ']' on line %d.\n", line);
+            exit(1);
         }
+        skip_ws(json);
     }
-    double* returnVals = malloc(sizeof(double)*2);
-    returnVals[0] = best_t;
-    returnVals[1] = (double)best_object;
-    return returnVals;
 }
 
-//this function calculates the color for a given coordinate based on the vector of the ray cast,
-//that vector's origin, and any given object or light.  It also support recursion for the calculation of
-//reflection and refraction.
-double* shade(double best_t, int best_object, int numOfObjects, Object* objects, int numOfLights, Light* lights,  double* Ro, double* Rd, int level)
+//this function reads a batch manifest, a json list of jobs such as
+//    {"scene": "input.json", "width": 200, "height": 200, "output": "red.png", "overrides": [{"light": 0, "color": [1, 0, 0]}]}
+//into a newly allocated array of jobs and returns the number of jobs.  Errors in the manifest exit the program.
+int read_batch(char* filename, BatchJob** result)
 {
-    double color[3] = {0,0,0}; //ambient lighting is 0
-    if(level > MAX_RECURSION) //check the base case
+    SceneFile file;
+    SceneFile* json = &file;
+    map_file(filename, json);
+    BatchJob* jobs = NULL;
+    int count = 0;
+    int capacity = 0;
+    int c;
+    skip_ws(json);
+    expect_c(json, '[');
+    skip_ws(json);
+    c = next_c(json);
+    if (c == ']')
     {
-        double* returnVal = malloc(sizeof(double)*3);
-        returnVal[0] = color[0];
-        returnVal[1] = color[1];
-        returnVal[2] = color[2];
-        return returnVal;
+        fprintf(stderr, "Error: Batch manifest \"%s\" contains no jobs.\n", filename);
+        exit(1);
     }
-    else //otherwise calculate the color
+    unget_c(json);
+    while (1)
     {
-        //Ron = best_t * Rd + Ro;
-        double Ron[3] = {0, 0, 0};
-        double test[3] = {0, 0, 0};
-        v3_scale(Rd, best_t, test);
-        v3_add(test, Ro, Ron);
-
-        int j;
-        for (j=0; j < numOfLights; j+=1)
+        jobs = grow_array(jobs, count, &capacity, sizeof(BatchJob));
+        BatchJob* job = &jobs[count];
+        memset(job, 0, sizeof(BatchJob));
+        expect_c(json, '{');
+        skip_ws(json);
+        c = next_c(json);
+        while (c != '}') //read each property of the job
         {
-            // Shadow test
-            double Rdn[3] = {0, 0, 0};
-            //Rdn = light_position - Ron;
-            v3_subtract(lights[j*sizeof(Light)].position, Ron, Rdn);
-            double best_lobjt = INFINITY; //find the minimum best t intersection of any object
-            int closest_shadow_object = -1; //keep track of the corresponding object's index
-            double distance_to_light = sqrt(sqr(Rdn[0]) + sqr(Rdn[1]) + sqr(Rdn[2]));
-            normalize(Rdn);
-
-            //find the closest object to the shadow for shadow omission
-            double* ricochet2 = shoot(&Ron, &Rdn, best_lobjt, closest_shadow_object, numOfObjects, &objects[0], distance_to_light, best_object);
-
-            best_lobjt = ricochet2[0];
-            closest_shadow_object = (int)ricochet2[1];
-
-
-            if (closest_shadow_object == -1)
+            unget_c(json);
+            JsonString key = next_string(json);
+            skip_ws(json);
+            expect_c(json, ':');
+            skip_ws(json);
+            if (json_eq(key, "scene")) job->scene = copy_string(next_string(json));
+            else if (json_eq(key, "output")) job->output = copy_string(next_string(json));
+            else if (json_eq(key, "width")) job->width = (int)next_number(json);
+            else if (json_eq(key, "height")) job->height = (int)next_number(json);
+            else if (json_eq(key, "overrides")) read_overrides(json, job);
+            else
             {
-
-                // N, L, R, V
-                double n[3] = {0, 0, 0};
-                double l[3] = {0, 0, 0};
-                double r[3] = {0, 0, 0};
-                double v[3] = {0, 0, 0};
-                double diffuse[3] = {0, 0, 0};
-                double specular[3] = {0, 0, 0};
-
-
-                //N = closest_object->normal; // plane
-                //N = Ron - closest_object->center; // sphere
-                if(objects[best_object*sizeof(Object)].kind  == 0)
-                {
-                    //camera found, do nothing
-                }
-                else if(objects[best_object*sizeof(Object)].kind  == 1)
-                {
-                    v3_subtract(Ron, objects[best_object*sizeof(Object)].sphere.center, n);
-                }
-                else if(objects[best_object*sizeof(Object)].kind  == 2)
-                {
-                    v3_scale(objects[best_object*sizeof(Object)].plane.normal, 1.0, n);
-                }
-                else
-                {
-                    fprintf(stderr, "Error: Unexpected object struct type located in memory, N could not be calculated.\n");
-                    exit(1);
-                }
-                normalize(n);
-
-                //L = Rdn; // light_position - Ron;
-                v3_scale(Rdn, 1.0, l);
-                normalize(l);
-
-                //R = reflection of L = (2N dot L)N - L;
-                double res[3] = {0, 0, 0};
-                double scaleFactor = 0.0;
-                v3_scale(n, 2.0, res); //2N
-                scaleFactor = v3_dot(res, l); //(2n dot L)
-                v3_scale(n, scaleFactor, res); //(2n dot L)N
-                v3_subtract(res, l, r); //(2N dot L)N - L = R
-
-
-                //V = Rd;
-                v3_scale(Rd, -1.0, v);
-
-                //calculates the diffuse light on an object based off of the equation
-                //Ksubd * IsubL * (N dot L) only if N dot L is greater than 0
-                double ndotl = v3_dot(n, l);
-                if(ndotl <= 0)
-                {
-                    ndotl = 0;
-                }
-
-                diffuse[0] = ndotl*objects[best_object*sizeof(Object)].diffuse_color[0]*lights[j*sizeof(Light)].color[0];
-                diffuse[1] = ndotl*objects[best_object*sizeof(Object)].diffuse_color[1]*lights[j*sizeof(Light)].color[1];
-                diffuse[2] = ndotl*objects[best_object*sizeof(Object)].diffuse_color[2]*lights[j*sizeof(Light)].color[2];
-
-                //calculates the specular light on an object based off of the equation
-                //Ksubs * IsubL * (V dot R)^ns only if N dot L and V dot R are greater than 0
-                double vdotr = v3_dot(v, r);
-                if(vdotr <= 0)
-                {
-                    vdotr = 0;
-                }
-
-                if(vdotr > 0 && ndotl > 0)
-                {
-                    specular[0] = pow(vdotr, ns)*objects[best_object*sizeof(Object)].specular_color[0]*lights[j*sizeof(Light)].color[0];
-                    specular[1] = pow(vdotr, ns)*objects[best_object*sizeof(Object)].specular_color[1]*lights[j*sizeof(Light)].color[1];
-                    specular[2] = pow(vdotr, ns)*objects[best_object*sizeof(Object)].specular_color[2]*lights[j*sizeof(Light)].color[2];
-                }
-
-                double angular_a0;
-                double light_dir[3] = {0,0,0};
-
-                //get the light's direction if it has one so that it can be passed into fang
-                if(lights[j*sizeof(Light)].kind == 1)
-                {
-                    light_dir[0] = lights[j*sizeof(Light)].spotlight.direction[0];
-                    light_dir[1] = lights[j*sizeof(Light)].spotlight.direction[1];
-                    light_dir[2] = lights[j*sizeof(Light)].spotlight.direction[2];
-                    angular_a0 = lights[j*sizeof(Light)].spotlight.angular_a0;
-                }
-
-                //get vobject so it can be passed into fang
-                double vobject[3] = {0, 0, 0};
-                v3_scale(Rdn, -1, vobject);
-                normalize(vobject);
-
-                //summation of all lights' effect on a given coordinate
-                color[0] += fang(lights[j*sizeof(Light)].kind,
-                                 lights[j*sizeof(Light)].theta,
-                                 light_dir, vobject,
-                                 lights[j*sizeof(Light)].spotlight.angular_a0)
-                            *frad(lights[j*sizeof(Light)].radial_a0,
-                                  lights[j*sizeof(Light)].radial_a1,
-                                  lights[j*sizeof(Light)].radial_a2,
-                                  best_t, Ro, Rd,
-                                  lights[j*sizeof(Light)].position)*(diffuse[0] + specular[0]); //frad() * fang() * (diffuse + specular);
-                color[1] += fang(lights[j*sizeof(Light)].kind,
-                                 lights[j*sizeof(Light)].theta,
-                                 light_dir, vobject,
-                                 lights[j*sizeof(Light)].spotlight.angular_a0)
-                            *frad(lights[j*sizeof(Light)].radial_a0,
-                                  lights[j*sizeof(Light)].radial_a1,
-                                  lights[j*sizeof(Light)].radial_a2,
-                                  best_t, Ro, Rd,
-                                  lights[j*sizeof(Light)].position)*(diffuse[1] + specular[1]);//frad() * fang() * (diffuse + specular);
-                color[2] += fang(lights[j*sizeof(Light)].kind,
-                                 lights[j*sizeof(Light)].theta,
-                                 light_dir, vobject,
-                                 lights[j*sizeof(Light)].spotlight.angular_a0)
-                            *frad(lights[j*sizeof(Light)].radial_a0,
-                                  lights[j*sizeof(Light)].radial_a1,
-                                  lights[j*sizeof(Light)].radial_a2,
-                                  best_t, Ro, Rd,
-                                  lights[j*sizeof(Light)].position)*(diffuse[2] + specular[2]);//frad() * fang() * (diffuse + specular);
-            }
-        }
-
-        //grab the closest object's reflectivity, refractivity, and index of refraction
-        double kr = objects[best_object*sizeof(Object)].sphere.reflectivity;
-        double kt = objects[best_object*sizeof(Object)].sphere.refractivity;
-        double ior = objects[best_object*sizeof(Object)].sphere.ior;
-
-        if((kr != 0 || kt != 0) && kt+kr<1) //only calculate reflection/refraction if there is reflection/refraction values and their sum is less than 1
-        {
-            // N, L, R, V
-            double n[3] = {0, 0, 0};
-            double l[3] = {0, 0, 0};
-            double r[3] = {0, 0, 0};
-            double v[3] = {0, 0, 0};
-
-            //N = closest_object->normal; // plane
-            //N = Ron - closest_object->center; // sphere
-            if(objects[best_object*sizeof(Object)].kind  == 0)
-            {
-                //camera found, do nothing
-            }
-            else if(objects[best_object*sizeof(Object)].kind  == 1)
-            {
-                v3_subtract(Ron, objects[best_object*sizeof(Object)].sphere.center, n);
-            }
-            else if(objects[best_object*sizeof(Object)].kind  == 2)
-            {
-                v3_scale(objects[best_object*sizeof(Object)].plane.normal, 1.0, n);
+                fprintf(stderr, "Error: Unknown property, \"%.*s\", on line %d.\n", key.length, key.start, line);
+                exit(1);
             }
-            else
+            skip_ws(json);
+            c = next_c(json);
+            if (c == ',')
+            {
+                skip_ws(json);
+                c = next_c(json);
+            }
+            else if (c != '}')
             {
-                fprintf(stderr, "Error: Unexpected object struct type located in memory, N could not be calculated.\n");
+                fprintf(stderr, "Error: Expecting ',' or '}' on line %d.\n", line);
                 exit(1);
             }
-            normalize(n);
-
-            //reflection calculation
-            double reflection[3] = {0,0,0};
-            v3_reflect(n, Rd, reflection);
-            normalize(reflection);
-
-            double newbest_t = INFINITY; //find the minimum best t intersection of any object
-            int newbest_object = -1; //keep track of the corresponding object's index
-            double* newricochet = shoot(&Ron, &reflection, newbest_t, newbest_object, numOfObjects, &objects[0], 0, 0);
-
-            newbest_t = newricochet[0];
-            newbest_object = (int)newricochet[1];
-
-            double Roprime[3] = {0,0,0};
-            v3_scale(Rd, 0.01, Roprime);
-            v3_add(Roprime, Ron, Roprime);
-
-            double* reflected_color = shade(newbest_t, newbest_object, numOfObjects, &objects[0], numOfLights, &lights[0], &Roprime, &reflection, level+1);
-
+        }
+        if (job->scene == NULL || job->output == NULL || job->width <= 0 || job->height <= 0)
+        {
+            fprintf(stderr, "Error: Job ending on line %d needs a scene, an output, and a width and height above zero.\n", line);
+            exit(1);
+        }
+        count++;
+        skip_ws(json);
+        c = next_c(json);
+        if (c == ']') break;
+        if (c != ',')
+        {
+            fprintf(stderr, "Error: Expecting ',' or ']' on line %d.\n", line);
+            exit(1);
+        }
+        skip_ws(json);
+    }
+    munmap(file.data, file.length);
+    *result = jobs;
+    return count;
+}
 
-            //refraction calculation
-            double refraction[3] = {0,0,0};
+//this function calculates the t-value that the input ray intersects with an object
+//based on the sphere's center position and squared radius that are each passed into the function.
+//Every ray is shot along a unit direction, so the quadratic's a is 1 and isn't worked out.
+Real sphere_intersection(Real* Ro, Real* Rd,
+                           Real* C, Real r2)
+{
+    Real oc[3] = {Ro[0] - C[0], Ro[1] - C[1], Ro[2] - C[2]}; //vector from the center to the ray's origin
+    Real b = oc[0]*Rd[0] + oc[1]*Rd[1] + oc[2]*Rd[2];        //half of the quadratic's b
+    Real c = oc[0]*oc[0] + oc[1]*oc[1] + oc[2]*oc[2] - r2;
 
-            double ncrossrd[3] = {0,0,0};
-            v3_cross(n, Rd, ncrossrd);
-            double magnitudeNcrossrd;
-            magnitudeNcrossrd = sqrt(sqr(ncrossrd[0]) + sqr(ncrossrd[1]) + sqr(ncrossrd[2]));
-            double a[3] = {0,0,0};
-            v3_scale(ncrossrd, 1.0/magnitudeNcrossrd, a);
+    Real det = sqr(b) - c; //use b and c to calculate the determinant
+    if (det < 0) return -1;  //returns -1 if the ray misses the sphere
 
-            double b[3] = {0,0,0};
-            v3_cross(a, n, b);
+    det = sqrt(det);
 
-            double magnitudeRd = sqrt(sqr(Rd[0]) + sqr(Rd[1]) + sqr(Rd[2]));
-            double magnitudeN = sqrt(sqr(n[0]) + sqr(n[1]) + sqr(n[2]));
-            double unitRd[3] = {0,0,0};
-            double unitN[3] = {0,0,0};
-            v3_scale(Rd, 1.0/magnitudeRd, unitRd);
-            v3_scale(n, 1.0/magnitudeN, unitN);
+    Real t0 = -b - det;    //find the first t value, which is smaller
+    if (t0 > 0) return t0; //return it if it is positive
 
-            double theta = acos(v3_dot(unitRd, unitN));
-            double phi = asin(sin(theta)/ior);
+    Real t1 = -b + det;    //find the larger second t value
+    if (t1 > 0) return t1; //return it if it is positive
 
-            double temp[3] = {0,0,0};
-            v3_scale(n, -cos(phi), temp);
-            v3_scale(b, sin(phi), refraction);
+    return -1;             //return -1 if there are no positive points of intersection
+}
 
-            v3_add(refraction, temp, refraction);
+//this function calculates the t-value of the intersection of an input ray with a plane
+//based on the plane's unit normal N and offset D.
+Real plane_intersection(Real* Ro, Real* Rd,
+                          Real* N, Real D)
+{
+    //t = -(AX0 + BY0 + CZ0 + D) / (AXd + BYd + CZd);
+    return -(N[0]*Ro[0] + N[1]*Ro[1] + N[2]*Ro[2] + D) / (N[0]*Rd[0] + N[1]*Rd[1] + N[2]*Rd[2]);
+}
 
+//this function returns the surface area of the box with the given corners, used by the surface area heuristic
+Real box_area(Real* bmin, Real* bmax)
+{
+    Real dx = bmax[0] - bmin[0];
+    Real dy = bmax[1] - bmin[1];
+    Real dz = bmax[2] - bmin[2];
+    return 2*(dx*dy + dy*dz + dz*dx);
+}
 
-            double refnewbest_t = INFINITY; //find the minimum best t intersection of any object
-            int refnewbest_object = -1; //keep track of the corresponding object's index
-            double* refnewricochet = shoot(&Ron, &refraction, refnewbest_t, refnewbest_object, numOfObjects, &objects[0], 0, 0);
+//this function grows the box with the given corners so that it also encloses the box lo-hi
+void box_grow(Real* bmin, Real* bmax, Real* lo, Real* hi)
+{
+    int k;
+    for (k = 0; k < 3; k += 1)
+    {
+        if (lo[k] < bmin[k]) bmin[k] = lo[k];
+        if (hi[k] > bmax[k]) bmax[k] = hi[k];
+    }
+}
 
-            refnewbest_t = refnewricochet[0];
-            refnewbest_object = (int)refnewricochet[1];
+//this function stores the bounding box of a sphere object into lo and hi
+void sphere_bounds(Object* sphere, Real* lo, Real* hi)
+{
+    int k;
+    for (k = 0; k < 3; k += 1)
+    {
+        lo[k] = sphere->sphere.center[k] - sphere->sphere.radius;
+        hi[k] = sphere->sphere.center[k] + sphere->sphere.radius;
+    }
+}
 
+//this function recursively builds the bvh node at index node over the spheres sphereObject[first] to sphereObject[first+count-1].
+//Each split is chosen by binning the sphere centers along every axis and picking the plane with the lowest
+//surface area heuristic cost.  Nodes that are small, too deep for the traversal stack, or that no split
+//would make cheaper, become leaves.
+void build_bvh_node(Scene* scene, int node, int first, int count, int depth)
+{
+    Object* objects = scene->objects;
+    int* items = scene->sphereObject;
+    BvhNode* n = &scene->nodes[node];
+    Real lo[3], hi[3];
+    Real cmin[3] = {INFINITY, INFINITY, INFINITY};    //bounds of the sphere centers
+    Real cmax[3] = {-INFINITY, -INFINITY, -INFINITY};
+    int i, k;
 
-            double* refracted_color = shade(refnewbest_t, refnewbest_object, numOfObjects, &objects[0], numOfLights, &lights[0], &Ron, &refraction, level+1);
+    n->bmin[0] = n->bmin[1] = n->bmin[2] = INFINITY;
+    n->bmax[0] = n->bmax[1] = n->bmax[2] = -INFINITY;
+    for (i = first; i < first + count; i += 1)
+    {
+        Object* sphere = &objects[items[i]];
+        sphere_bounds(sphere, lo, hi);
+        box_grow(n->bmin, n->bmax, lo, hi);
+        box_grow(cmin, cmax, sphere->sphere.center, sphere->sphere.center);
+    }
+    n->first = first;
+    n->count = count;
+    if (count <= BVH_LEAF_SIZE || depth >= BVH_STACK - 1) return;
 
-            if(newbest_t != INFINITY)
+    //find the cheapest split over every axis
+    Real best_cost = INFINITY;
+    int best_axis = -1;
+    int best_bin = 0;
+    for (k = 0; k < 3; k += 1)
+    {
+        Real extent = cmax[k] - cmin[k];
+        if (extent <= 0) continue; //every center is on the same plane along this axis
+        int binCount[BVH_BINS] = {0};
+        Real binMin[BVH_BINS][3], binMax[BVH_BINS][3];
+        int b;
+        for (b = 0; b < BVH_BINS; b += 1)
+        {
+            binMin[b][0] = binMin[b][1] = binMin[b][2] = INFINITY;
+            binMax[b][0] = binMax[b][1] = binMax[b][2] = -INFINITY;
+        }
+        for (i = first; i < first + count; i += 1)
+        {
+            Object* sphere = &objects[items[i]];
+            b = (int)(BVH_BINS * (sphere->sphere.center[k] - cmin[k]) / extent);
+            if (b >= BVH_BINS) b = BVH_BINS - 1;
+            sphere_bounds(sphere, lo, hi);
+            box_grow(binMin[b], binMax[b], lo, hi);
+            binCount[b] += 1;
+        }
+        //sweep from the right to get the area and count to the right of every bin boundary
+        Real rightArea[BVH_BINS];
+        int rightCount[BVH_BINS];
+        Real rmin[3] = {INFINITY, INFINITY, INFINITY};
+        Real rmax[3] = {-INFINITY, -INFINITY, -INFINITY};
+        int rc = 0;
+        for (b = BVH_BINS - 1; b > 0; b -= 1)
+        {
+            box_grow(rmin, rmax, binMin[b], binMax[b]);
+            rc += binCount[b];
+            rightCount[b] = rc;
+            rightArea[b] = rc > 0 ? box_area(rmin, rmax) : 0;
+        }
+        //then sweep from the left and cost every boundary
+        Real lmin[3] = {INFINITY, INFINITY, INFINITY};
+        Real lmax[3] = {-INFINITY, -INFINITY, -INFINITY};
+        int lc = 0;
+        for (b = 0; b < BVH_BINS - 1; b += 1)
+        {
+            box_grow(lmin, lmax, binMin[b], binMax[b]);
+            lc += binCount[b];
+            if (lc == 0 || rightCount[b+1] == 0) continue;
+            Real cost = lc*box_area(lmin, lmax) + rightCount[b+1]*rightArea[b+1];
+            if (cost < best_cost)
             {
-                //sum of the different I values
-                color[0] = (1-kr-kt)*color[0]+kr*reflected_color[0]+kt*refracted_color[0];//+kr*shade(recursive call to shade the reflection vector)+kt*shade(recursive call to shade the refraction vector)
-                color[1] = (1-kr-kt)*color[1]+kr*reflected_color[1]+kt*refracted_color[1];
-                color[2] = (1-kr-kt)*color[2]+kr*reflected_color[2]+kt*refracted_color[2];
+                best_cost = cost;
+                best_axis = k;
+                best_bin = b;
             }
         }
+    }
+    //stop if splitting is no cheaper than testing every sphere in this node
+    if (best_axis == -1 || best_cost >= count*box_area(n->bmin, n->bmax)) return;
 
-        //return the final color value
-        double* returnVal = malloc(sizeof(double)*3);
-        returnVal[0] = color[0];
-        returnVal[1] = color[1];
-        returnVal[2] = color[2];
-        return returnVal;
+    //partition the spheres on either side of the chosen bin boundary
+    Real extent = cmax[best_axis] - cmin[best_axis];
+    int mid = first;
+    for (i = first; i < first + count; i += 1)
+    {
+        Object* sphere = &objects[items[i]];
+        int b = (int)(BVH_BINS * (sphere->sphere.center[best_axis] - cmin[best_axis]) / extent);
+        if (b >= BVH_BINS) b = BVH_BINS - 1;
+        if (b <= best_bin)
+        {
+            int swap = items[i];
+            items[i] = items[mid];
+            items[mid] = swap;
+            mid += 1;
+        }
     }
-}
 
+    int child = scene->numOfNodes;
+    scene->numOfNodes += 2;
+    n->first = child;
+    n->count = 0;
+    build_bvh_node(scene, child, first, mid - first, depth + 1);
+    build_bvh_node(scene, child + 1, mid, first + count - mid, depth + 1);
+}
 
-//this function takes in the number of objects and lights in the input json file, memory where those objects and lights are stored,
-//and a buffer to store the data of each pixel.  It then uses the camera information to display the intersections
-//of raycasts and the objects those raycasts are hitting to store RGB pixel values for that spot of intersection
-//as observed by the camera position.  It also illuminates those objects based on the information in the lights buffer.
-void store_pixels(int numOfObjects, int numOfLights, Object* objects, Pixel* data, Light* lights)
+//this function builds the bounding volume hierarchy over the spheres of a parsed scene, leaving sphereObject
+//ordered so that each leaf's spheres are contiguous, and collects its planes, which have no bounds, into planeObject.
+void build_bvh(Scene* scene)
 {
-    double cx, cy, h, w;
-    cx = 0;  //default camera values
-    cy = 0;  // ||
-    h = 1;   // ||
-    w = 1;   // ||
+    int numOfSpheres = 0;
     int i;
-    int found = 0; //tell whether a camera is found or not
-    for (i=0; i < numOfObjects; i += 1) //get the first camera's x/y positions and width/height
+    scene->sphereObject = malloc(sizeof(int)*(scene->numOfObjects + 1));
+    scene->planeObject = malloc(sizeof(int)*(scene->numOfObjects + 1));
+    scene->numOfPlanes = 0;
+    for (i = 0; i < scene->numOfObjects; i += 1)
     {
-        if(objects[i*sizeof(Object)].kind == 0)
-        {
-            w = objects[i*sizeof(Object)].camera.width;
-            h = objects[i*sizeof(Object)].camera.height;
-            cx = objects[i*sizeof(Object)].camera.center[0];
-            cy = objects[i*sizeof(Object)].camera.center[1];
-            found = 1;
-            break;
-        }
+        if (scene->objects[i].kind == 1) scene->sphereObject[numOfSpheres++] = i;
+        else if (scene->objects[i].kind == 2) scene->planeObject[scene->numOfPlanes++] = i;
     }
-    if(found != 1) //if a camera was not found in the list of objects, print an error but continue with default camera values
+    scene->numOfSpheres = numOfSpheres;
+    //a binary tree with one sphere per leaf at worst has 2n-1 nodes
+    scene->nodes = malloc(sizeof(BvhNode)*(2*numOfSpheres + 1));
+    scene->numOfNodes = 1;
+    if (numOfSpheres == 0) //the empty root is never walked, its inverted bounds and count of 0 would read as a node with children
     {
-        fprintf(stderr, "Error: A camera object was not found in the input json file.\n\tUsing default camera position: (%f,%f)\n\tUsing default camera width: %f\n\tUsing default camera height: %f\n", cx, cy, w, h);
+        scene->nodes[0].count = 0;
+        scene->nodes[0].first = 0;
+        scene->nodes[0].bmin[0] = scene->nodes[0].bmin[1] = scene->nodes[0].bmin[2] = INFINITY;
+        scene->nodes[0].bmax[0] = scene->nodes[0].bmax[1] = scene->nodes[0].bmax[2] = -INFINITY;
+        return;
     }
+    build_bvh_node(scene, 0, 0, numOfSpheres, 0);
+    scene->nodes = realloc(scene->nodes, sizeof(BvhNode)*scene->numOfNodes); //trim the nodes to the number used
+}
 
-    int M = pheight; //M is equal to the input command line height
-    int N = pwidth;  //N is equal to the input command line width
-
-    double pixheight = h / M; //pixel height and width of the area to be raycasted
-    double pixwidth = w / N;
-
-    int y, x; //loop control variables
+//this function compiles a parsed scene into the form rays are traced against.  It builds the bvh, then copies
+//each sphere's center, squared radius, and inverse radius into the geometry arrays in bvh leaf order, each plane's
+//unit normal and offset into the plane arrays, and every object's shading attributes into the material table.
+//It is called once after read_scene().
+void compile_shading(Scene* scene);
+void compile_scene(Scene* scene)
+{
+    int i, k;
+    build_bvh(scene);
 
-    printf("calculating intersections and storing intersection pixels...\n");
-    for (y = 0; y < M; y += 1)
+    scene->sphereCenter = malloc(sizeof(Real)*3*(scene->numOfSpheres + 1));
+    scene->sphereR2 = malloc(sizeof(Real)*(scene->numOfSpheres + 1));
+    scene->sphereInvRadius = malloc(sizeof(Real)*(scene->numOfSpheres + 1));
+    for (i = 0; i < scene->numOfSpheres; i += 1)
     {
-        for (x = 0; x < N; x += 1)
-        {
-            double Ro[3] = {0, 0, 0};
-            // Rd = normalize(P - Ro)
-            double Rd[3] =
-            {
-                cx - (w/2) + pixwidth * (x + 0.5),
-                cy - (h/2) + pixheight * (y + 0.5),
-                1
-            };
-            normalize(Rd);
-
-
-            double best_t = INFINITY; //find the minimum best t intersection of any object
-            int best_object = -1; //keep track of the corresponding object's index
-
-            double* ricochet = shoot(&Ro, &Rd, best_t, best_object, numOfObjects, &objects[0], 0, 0);
-
-            best_t = ricochet[0];
-            best_object = (int)ricochet[1];
-
-            double color[3] = {0,0,0}; //ambient lighting is 0
-            double* resultcolor = shade(best_t, best_object, numOfObjects, &objects[0], numOfLights, &lights[0], &Ro, &Rd, 0);
-            color[0] = resultcolor[0];
-            color[1] = resultcolor[1];
-            color[2] = resultcolor[2];
+        Object* sphere = &scene->objects[scene->sphereObject[i]];
+        for (k = 0; k < 3; k += 1) scene->sphereCenter[i*3+k] = sphere->sphere.center[k];
+        scene->sphereR2[i] = sqr(sphere->sphere.radius);
+        scene->sphereInvRadius[i] = 1 / sphere->sphere.radius;
+    }
 
+    scene->planeNormal = malloc(sizeof(Real)*3*(scene->numOfPlanes + 1));
+    scene->planeOffset = malloc(sizeof(Real)*(scene->numOfPlanes + 1));
+    for (i = 0; i < scene->numOfPlanes; i += 1)
+    {
+        Object* plane = &scene->objects[scene->planeObject[i]];
+        Real* n = &scene->planeNormal[i*3];
+        for (k = 0; k < 3; k += 1) n[k] = plane->plane.normal[k];
+        normalize(n);
+        scene->planeOffset[i] = -v3_dot(n, plane->plane.center); //D = -N.P for the point P on the plane
+    }
 
-            if (best_t > 0 && best_t != INFINITY) //if the intersection is in the viewplane and isn't infinity, store its object's color into the buffer
-            {
-                //at the correct x,y location
-                //printf("here. x %d\ty %d\n", x, y);
-                Pixel temporary;
-                temporary.r = (int)(clamp(color[0])*255);
-                temporary.g = (int)(clamp(color[1])*255);
-                temporary.b = (int)(clamp(color[2])*255);
-                *(data+(sizeof(Pixel)*pheight*pwidth)-(y+1)*pwidth*sizeof(Pixel)+x*sizeof(Pixel)) = temporary;
-            }
-            else //no point of intersection was found for any object at the given x,y so put black into that x,y pixel into the buffer
-            {
-                //printf("here. x %3d\ty %3d\n", x, y);
-                Pixel temporary;
-                temporary.r = 0;
-                temporary.g = 0;
-                temporary.b = 0;
-                *(data+(sizeof(Pixel)*pheight*pwidth)-(y+1)*pwidth*sizeof(Pixel)+x*sizeof(Pixel)) = temporary;
-            }
-        } //end of x iteration
-    } //end of y iteration
+    scene->materials = malloc(sizeof(Material)*(scene->numOfObjects + 1));
+    scene->compiledLights = malloc(sizeof(CompiledLight)*(scene->numOfLights + 1));
+    scene->mapping = NULL;
+    compile_shading(scene);
 }
 
-
-int main(int argc, char* argv[])
+//this function copies every object's shading attributes into the scene's material table and compiles its lights.
+//It only reads properties that don't affect the bvh, so it can be called again after they are changed.
+void compile_shading(Scene* scene)
+{
+    int i, k;
+    for (i = 0; i < scene->numOfObjects; i += 1)
+    {
+        Object* object = &scene->objects[i];
+        Material* m = &scene->materials[i];
+        m->kind = object->kind;
+        m->geometry = -1;
+        for (k = 0; k < 3; k += 1)
+        {
+            m->diffuse_color[k] = object->diffuse_color[k];
+            m->specular_color[k] = object->specular_color[k];
+        }
+        //planes share these fields with spheres in the object union, so they are read the same way for both
+        m->reflectivity = object->sphere.reflectivity;
+        m->refractivity = object->sphere.refractivity;
+        m->ior = object->sphere.ior;
+    }
+    for (i = 0; i < scene->numOfSpheres; i += 1) scene->materials[scene->sphereObject[i]].geometry = i;
+    for (i = 0; i < scene->numOfPlanes; i += 1) scene->materials[scene->planeObject[i]].geometry = i;
+
+    for (i = 0; i < scene->numOfLights; i += 1)
+    {
+        Light* light = &scene->lights[i];
+        CompiledLight* c = &scene->compiledLights[i];
+        c->kind = light->kind;
+        for (k = 0; k < 3; k += 1)
+        {
+            c->position[k] = light->position[k];
+            c->color[k] = light->color[k];
+            c->direction[k] = light->kind == 1 ? light->spotlight.direction[k] : 0;
+        }
+        c->a0 = light->radial_a0;
+        c->a1 = light->radial_a1;
+        c->a2 = light->radial_a2;
+        if (light->kind == 1)
+        {
+            normalize(c->direction);
+            c->cos_theta = cos(light->theta*(M_PI/180));
+            c->angular_a0 = light->spotlight.angular_a0;
+        }
+        else
+        {
+            c->cos_theta = -1;
+            c->angular_a0 = 0;
+        }
+    }
+}
+
+//this function returns the number of bytes used by a scene's objects, lights, and compiled form
+size_t scene_memory(Scene* scene)
+{
+    size_t bytes = sizeof(Object)*scene->numOfObjects + sizeof(Light)*scene->numOfLights;
+    bytes += sizeof(BvhNode)*scene->numOfNodes;
+    bytes += (sizeof(Real)*5 + sizeof(int))*scene->numOfSpheres;
+    bytes += (sizeof(Real)*4 + sizeof(int))*scene->numOfPlanes;
+    bytes += sizeof(Material)*scene->numOfObjects + sizeof(CompiledLight)*scene->numOfLights;
+    return bytes;
+}
+
+//this function frees the memory used by the compiled form of a scene
+void free_compiled_scene(Scene* scene)
+{
+    free(scene->nodes);
+    free(scene->sphereCenter);
+    free(scene->sphereR2);
+    free(scene->sphereInvRadius);
+    free(scene->sphereObject);
+    free(scene->planeNormal);
+    free(scene->planeOffset);
+    free(scene->planeObject);
+    free(scene->materials);
+    free(scene->compiledLights);
+}
+
+//this function frees a scene and its compiled form, or unmaps it if it was loaded from a compiled scene file
+void free_scene(Scene* scene)
+{
+    if (scene->mapping != NULL)
+    {
+        munmap(scene->mapping, scene->mappingLength);
+        return;
+    }
+    free_compiled_scene(scene);
+    free(scene->lights);
+    free(scene->objects);
+}
+
+//this function returns the distance along the ray at which it enters the given box, or INFINITY if
+//it misses the box or only reaches it beyond limit.  invRd holds 1/Rd for each axis.
+Real box_intersection(Real* Ro, Real* invRd, Real* bmin, Real* bmax, Real limit)
+{
+    Real tmin = 0;
+    Real tmax = limit;
+    int k;
+    for (k = 0; k < 3; k += 1)
+    {
+        Real t0 = (bmin[k] - Ro[k]) * invRd[k];
+        Real t1 = (bmax[k] - Ro[k]) * invRd[k];
+        if (t0 > t1)
+        {
+            Real swap = t0;
+            t0 = t1;
+            t1 = swap;
+        }
+        if (t0 > tmin) tmin = t0;
+        if (t1 < tmax) tmax = t1;
+        if (tmin > tmax) return INFINITY;
+    }
+    return tmin;
+}
+
+//this function keeps track of the closest intersection seen so far.  Ties go to the object that comes
+//first in the scene file, so that the result does not depend on the order in which objects are tested.
+static inline void closer_hit(Real t, int i, Real* best_t, int* best_object)
+{
+    if (t > 0 && (t < *best_t || (t == *best_t && i < *best_object))) //if an object is in front of another object, ensure the front-most object is displayed
+    {
+        *best_t = t;
+        *best_object = i;
+    }
+}
+
+//this function calculates the closest t-value and closest object based on the input parameters of the function
+//and returns them as a hit record.
+//Planes are tested one by one and spheres are found by walking the scene's bvh, skipping any node whose box
+//the ray enters further away than the closest hit found so far.
+Hit shoot(Real* Ro, Real* Rd, Real best_t, int best_object, Scene* scene)
+{
+    Real t = 0;
+    int planeTests = 0, sphereTests = 0;
+
+    int i;
+    for (i = 0; i < scene->numOfPlanes; i += 1) //if the object is a plane, find its point of intersection
+    {
+        t = plane_intersection(Ro, Rd, &scene->planeNormal[i*3], scene->planeOffset[i]);
+        planeTests += 1;
+        closer_hit(t, scene->planeObject[i], &best_t, &best_object);
+    }
+
+    Real invRd[3] = {1/Rd[0], 1/Rd[1], 1/Rd[2]};
+    int stack[BVH_STACK];
+    int top = 0;
+    if (scene->numOfSpheres > 0 && box_intersection(Ro, invRd, scene->nodes[0].bmin, scene->nodes[0].bmax, best_t) != INFINITY) stack[top++] = 0;
+    while (top > 0)
+    {
+        Real limit = best_t; //nothing beyond the closest hit so far can matter
+        BvhNode* node = &scene->nodes[stack[--top]];
+        if (node->count > 0) //if the node is a leaf, find the minimum intersection of each of its spheres
+        {
+            for (i = node->first; i < node->first + node->count; i += 1)
+            {
+                t = sphere_intersection(Ro, Rd, &scene->sphereCenter[i*3], scene->sphereR2[i]);
+                sphereTests += 1;
+                closer_hit(t, scene->sphereObject[i], &best_t, &best_object);
+            }
+            continue;
+        }
+        //visit the nearer child first so the farther one can be skipped once something closer is found
+        BvhNode* left = &scene->nodes[node->first];
+        BvhNode* right = &scene->nodes[node->first + 1];
+        Real tleft = box_intersection(Ro, invRd, left->bmin, left->bmax, limit);
+        Real tright = box_intersection(Ro, invRd, right->bmin, right->bmax, limit);
+        if (tleft <= tright)
+        {
+            if (tright != INFINITY) stack[top++] = node->first + 1;
+            if (tleft != INFINITY) stack[top++] = node->first;
+        }
+        else
+        {
+            if (tleft != INFINITY) stack[top++] = node->first;
+            stack[top++] = node->first + 1;
+        }
+    }
+    if (collect_stats)
+    {
+        ray_stats.planeTests += planeTests;
+        ray_stats.sphereTests += sphereTests;
+        if (best_object != -1) ray_stats.hits += 1;
+        else ray_stats.misses += 1;
+    }
+    Hit hit;
+    hit.t = best_t;
+    hit.object = best_object;
+    return hit;
+}
+
+//this function moves the start of a ray leaving the surface point Ron along Rd by RAY_EPSILON, so that rounding
+//can't make the ray hit the surface it is leaving right where it starts
+static inline void ray_start(Real* Ron, Real* Rd, Real* origin)
+{
+    origin[0] = Ron[0] + Rd[0]*RAY_EPSILON;
+    origin[1] = Ron[1] + Rd[1]*RAY_EPSILON;
+    origin[2] = Ron[2] + Rd[2]*RAY_EPSILON;
+}
+
+//this function tells whether anything lies between the point Ro and a light the given distance away along the
+//unit direction Rd.  Unlike shoot() it doesn't look for the closest hit, it stops at the first blocker it finds.
+//The ray starts RAY_EPSILON along Rd so the surface it leaves can't block it while the rest of that object still can.
+int occluded(Real* Ro, Real* Rd, Real distance, Scene* scene)
+{
+    Real origin[3];
+    ray_start(Ro, Rd, origin);
+    Real limit = distance - RAY_EPSILON;
+    Real t;
+    int blocked = 0;
+    int planeTests = 0, sphereTests = 0;
+
+    int i;
+    for (i = 0; i < scene->numOfPlanes && !blocked; i += 1)
+    {
+        t = plane_intersection(origin, Rd, &scene->planeNormal[i*3], scene->planeOffset[i]);
+        planeTests += 1;
+        if (t > 0 && t < limit) blocked = 1;
+    }
+
+    Real invRd[3] = {1/Rd[0], 1/Rd[1], 1/Rd[2]};
+    int stack[BVH_STACK];
+    int top = 0;
+    if (!blocked && scene->numOfSpheres > 0 && box_intersection(origin, invRd, scene->nodes[0].bmin, scene->nodes[0].bmax, limit) != INFINITY) stack[top++] = 0;
+    while (top > 0 && !blocked)
+    {
+        BvhNode* node = &scene->nodes[stack[--top]];
+        if (node->count > 0)
+        {
+            for (i = node->first; i < node->first + node->count && !blocked; i += 1)
+            {
+                t = sphere_intersection(origin, Rd, &scene->sphereCenter[i*3], scene->sphereR2[i]);
+                sphereTests += 1;
+                if (t > 0 && t < limit) blocked = 1;
+            }
+            continue;
+        }
+        //any blocker will do, so the children are visited in whatever order without sorting them
+        if (box_intersection(origin, invRd, scene->nodes[node->first].bmin, scene->nodes[node->first].bmax, limit) != INFINITY)
+            stack[top++] = node->first;
+        if (box_intersection(origin, invRd, scene->nodes[node->first + 1].bmin, scene->nodes[node->first + 1].bmax, limit) != INFINITY)
+            stack[top++] = node->first + 1;
+    }
+    if (collect_stats)
+    {
+        ray_stats.planeTests += planeTests;
+        ray_stats.sphereTests += sphereTests;
+        if (blocked) ray_stats.hits += 1;
+        else ray_stats.misses += 1;
+    }
+    return blocked;
+}
+
+//this function calculates the normalized surface normal n of the given object at the point Ron on its surface
+void surface_normal(Scene* scene, int best_object, Real* Ron, Real* n)
+{
+    Material* material = &scene->materials[best_object];
+    //N = closest_object->normal; // plane
+    //N = (Ron - closest_object->center) / radius; // sphere
+    if(material->kind  == 1)
+    {
+        v3_subtract(Ron, &scene->sphereCenter[material->geometry*3], n);
+        v3_scale(n, scene->sphereInvRadius[material->geometry], n);
+    }
+    else if(material->kind  == 2)
+    {
+        v3_scale(&scene->planeNormal[material->geometry*3], 1.0, n);
+    }
+    else
+    {
+        fprintf(stderr, "Error: Unexpected object struct type located in memory, N could not be calculated.\n");
+        exit(1);
+    }
+}
+
+//this function adds the color the given light gives the point Ron, with normal n and direction v back toward the eye,
+//of an object with the given material.  Lights that can't light the point are skipped before a shadow ray is shot toward them.
+static inline void add_light(Scene* scene, Material* material, CompiledLight* light, Real* Ron, Real* n, Real* v, Real* color)
+{
+    //L = light_position - Ron;
+    Real l[3] = {0, 0, 0};
+    v3_subtract(light->position, Ron, l);
+    Real distance_to_light = sqrt(sqr(l[0]) + sqr(l[1]) + sqr(l[2]));
+    if (fast_math) v3_scale(l, 1/distance_to_light, l); //reuse the distance instead of taking another square root
+    else normalize(l);
+
+    //a point facing away from the light gets neither diffuse nor specular light from it
+    Real ndotl = v3_dot(n, l);
+    if(ndotl <= 0)
+    {
+        if (collect_stats) ray_stats.lightsCulled += 1;
+        return;
+    }
+
+    //spotlights light nothing outside of their cone, radial lights only fall off with distance
+    Real attenuation;
+    if(light->kind == 1)
+    {
+        attenuation = fang(light, l);
+        if(attenuation == 0)
+        {
+            if (collect_stats) ray_stats.spotlightSkipped += 1;
+            return;
+        }
+        attenuation *= frad(light, distance_to_light);
+    }
+    else
+    {
+        attenuation = frad(light, distance_to_light);
+    }
+
+    //skip the light if even a perfect specular highlight from it would be too dim to see.  Every light gets an equal
+    //share of LIGHT_CUTOFF, so all of the skipped lights together stay under half a step of a color channel.
+    Real brightest = 0;
+    int k;
+    for (k = 0; k < 3; k += 1)
+    {
+        Real most = light->color[k]*(ndotl*material->diffuse_color[k] + material->specular_color[k]);
+        if (most > brightest) brightest = most;
+    }
+    if(fabs(attenuation)*brightest*scene->numOfLights < LIGHT_CUTOFF)
+    {
+        if (collect_stats) ray_stats.lightsCulled += 1;
+        return;
+    }
+
+    //only light the point if nothing lies between it and the light
+    ray_stats.shadow += 1;
+    if (occluded(Ron, l, distance_to_light, scene)) return;
+
+    //R = reflection of L = (2N dot L)N - L;
+    Real r[3] = {0, 0, 0};
+    Real res[3] = {0, 0, 0};
+    v3_scale(n, 2*ndotl, res); //(2N dot L)N
+    v3_subtract(res, l, r); //(2N dot L)N - L = R
+
+    //calculates the diffuse light on an object based off of the equation
+    //Ksubd * IsubL * (N dot L), and the specular light based off of the equation
+    //Ksubs * IsubL * (V dot R)^ns only if V dot R is greater than 0
+    Real vdotr = v3_dot(v, r);
+    Real highlight = vdotr > 0 ? (fast_math ? pow_int(vdotr, ns) : pow(vdotr, ns)) : 0;
+
+    //summation of all lights' effect on a given coordinate, frad() * fang() * (diffuse + specular)
+    for (k = 0; k < 3; k += 1)
+    {
+        Real diffuse = ndotl*material->diffuse_color[k]*light->color[k];
+        Real specular = highlight*material->specular_color[k]*light->color[k];
+        color[k] += attenuation*(diffuse + specular);
+    }
+}
+
+//this function calculates the color a point receives directly from the lights, based on the vector of the ray cast,
+//that vector's origin, and the object it hit.  normal is the surface normal at the hit if it is already known, NULL to
+//have it calculated.  The point of intersection is stored into Ron, the normal into n, and the color into the
+//caller's color array.
+void shade_direct(Real best_t, int best_object, Scene* scene, Real* Ro, Real* Rd, Real* normal, Real* Ron, Real* n, Real* color)
+{
+    Material* material = &scene->materials[best_object]; //shading attributes of the object that was hit
+    color[0] = 0; //ambient lighting is 0
+    color[1] = 0;
+    color[2] = 0;
+    //Ron = best_t * Rd + Ro;
+    Real test[3] = {0, 0, 0};
+    v3_scale(Rd, best_t, test);
+    v3_add(test, Ro, Ron);
+
+    // N, V
+    Real v[3] = {0, 0, 0};
+    if (normal != NULL) v3_scale(normal, 1.0, n);
+    else surface_normal(scene, best_object, Ron, n);
+    //V = -Rd;
+    v3_scale(Rd, -1.0, v);
+
+    int j;
+    for (j=0; j < scene->numOfLights; j+=1)
+    {
+        add_light(scene, material, &scene->compiledLights[j], Ron, n, v, color);
+    }
+}
+
+//this function calculates the directions of the reflection and refraction rays leaving the given object where its
+//surface normal is n, which was hit by a ray along Rd.  It returns 0 without calculating them if the object has no
+//reflection or refraction values, or if their sum is not less than 1.
+int secondary_rays(int best_object, Scene* scene, Real* n, Real* Rd, Real* reflection, Real* refraction)
+{
+    Material* material = &scene->materials[best_object];
+    //grab the closest object's reflectivity, refractivity, and index of refraction
+    Real kr = material->reflectivity;
+    Real kt = material->refractivity;
+    Real ior = material->ior;
+    if(!((kr != 0 || kt != 0) && kt+kr<1)) //only calculate reflection/refraction if there is reflection/refraction values and their sum is less than 1
+    {
+        return 0;
+    }
+
+    //reflection calculation
+    v3_reflect(n, Rd, reflection);
+    normalize(reflection);
+
+    //refraction calculation
+    if(fast_math) //Snell's law in vector form, T = Rd/ior - N(cos(theta)/ior + cos(phi)), with no trigonometry
+    {
+        Real unitN[3] = {n[0], n[1], n[2]}; //a sphere's normal is only close to unit length when the hit lies off its surface
+        normalize(unitN);
+        Real cosTheta = v3_dot(Rd, unitN);
+        Real cosPhi = sqrt(1 - (1 - cosTheta*cosTheta)/(ior*ior));
+        Real temp[3] = {0,0,0};
+        v3_scale(unitN, cosTheta/ior + cosPhi, temp);
+        v3_scale(Rd, 1/ior, refraction);
+        v3_subtract(refraction, temp, refraction);
+        normalize(refraction);
+        return 1;
+    }
+    Real ncrossrd[3] = {0,0,0};
+    v3_cross(n, Rd, ncrossrd);
+    Real magnitudeNcrossrd;
+    magnitudeNcrossrd = sqrt(sqr(ncrossrd[0]) + sqr(ncrossrd[1]) + sqr(ncrossrd[2]));
+    Real a[3] = {0,0,0};
+    v3_scale(ncrossrd, 1.0/magnitudeNcrossrd, a);
+
+    Real b[3] = {0,0,0};
+    v3_cross(a, n, b);
+
+    Real magnitudeRd = sqrt(sqr(Rd[0]) + sqr(Rd[1]) + sqr(Rd[2]));
+    Real magnitudeN = sqrt(sqr(n[0]) + sqr(n[1]) + sqr(n[2]));
+    Real unitRd[3] = {0,0,0};
+    Real unitN[3] = {0,0,0};
+    v3_scale(Rd, 1.0/magnitudeRd, unitRd);
+    v3_scale(n, 1.0/magnitudeN, unitN);
+
+    Real theta = acos(v3_dot(unitRd, unitN));
+    Real phi = asin(sin(theta)/ior);
+
+    Real temp[3] = {0,0,0};
+    v3_scale(n, -cos(phi), temp);
+    v3_scale(b, sin(phi), refraction);
+
+    v3_add(refraction, temp, refraction);
+    normalize(refraction); //keep the ray a unit vector, which the intersection kernels rely on
+    return 1;
+}
+
+//this function hashes a pixel and a ray's position in that pixel's tree into a number from 0 up to 1, so that russian
+//roulette picks the same rays however the image is split between threads and whichever engine renders it
+double roulette_random(unsigned int pixel, unsigned int path)
+{
+    unsigned int h = pixel * 0x9E3779B1u ^ path * 0x85EBCA77u;
+    h ^= h >> 16;
+    h *= 0x7FEB352Du;
+    h ^= h >> 15;
+    h *= 0x846CA68Bu;
+    h ^= h >> 16;
+    return h / 4294967296.0;
+}
+
+//this function decides whether to follow a reflection or refraction at the given level, which can carry at most
+//weight of its pixel's color.  It returns the factor to multiply the ray's color by, or 0 if the ray is cut.
+//Rays past MAX_RECURSION are always black so they are cut, and rays below prune_threshold are cut too, or with --roulette
+//survive with probability weight/prune_threshold and have their color scaled up to make up for the ones that didn't.
+Real follow_weight(Real weight, int level, unsigned int path)
+{
+    if (prune_threshold <= 0) return 1;
+    if (level > MAX_RECURSION) return 0;
+    if (weight >= prune_threshold) return 1;
+    if (!roulette) return 0;
+    Real survive = weight / prune_threshold;
+    if (roulette_random(roulette_pixel, path) < survive) return 1 / survive;
+    return 0;
+}
+
+void shade_secondary(int best_object, Scene* scene, Real* Ron, Real* n, Real* Rd, int level, Real weight, unsigned int path, Real* color);
+
+//this function calculates the color for a given coordinate based on the vector of the ray cast,
+//that vector's origin, and any given object or light.  It also support recursion for the calculation of
+//reflection and refraction.  The ray can carry at most weight of its pixel's color and sits at the given path of the
+//pixel's tree, which decide whether its reflection and refraction are followed.  The color is stored into the caller's color array.
+void shade(Real best_t, int best_object, Scene* scene, Real* Ro, Real* Rd, Real* normal, int level, Real weight, unsigned int path, Real* color)
+{
+    color[0] = 0; //ambient lighting is 0
+    color[1] = 0;
+    color[2] = 0;
+    if (collect_stats) ray_stats.depth[level] += 1;
+    if(level > MAX_RECURSION || best_object == -1) //check the base case, and rays that hit nothing stay black
+    {
+        return;
+    }
+    else //otherwise calculate the color
+    {
+        Real Ron[3] = {0, 0, 0};
+        Real n[3] = {0, 0, 0};
+        shade_direct(best_t, best_object, scene, Ro, Rd, normal, Ron, n, color);
+        shade_secondary(best_object, scene, Ron, n, Rd, level, weight, path, color);
+    }
+}
+
+//this function blends the reflection and refraction of the point Ron, where a ray along Rd hit best_object with surface
+//normal n, into color, which holds the light the point receives directly.  The reflection and refraction are shaded
+//by shade(), with the ray's level, weight, and path deciding whether they are followed.
+void shade_secondary(int best_object, Scene* scene, Real* Ron, Real* n, Real* Rd, int level, Real weight, unsigned int path, Real* color)
+{
+    Real reflection[3] = {0,0,0};
+    Real refraction[3] = {0,0,0};
+    if(!secondary_rays(best_object, scene, n, Rd, reflection, refraction)) return;
+
+    Real kr = scene->materials[best_object].reflectivity;
+    Real kt = scene->materials[best_object].refractivity;
+    Real reflected_scale = follow_weight(weight*kr, level+1, path*2);
+    Real refracted_scale = follow_weight(weight*kt, level+1, path*2+1);
+
+    Real newbest_t = INFINITY; //find the minimum best t intersection of any object
+    int newbest_object = -1; //keep track of the corresponding object's index
+    ray_stats.reflection += 1;
+    Real reflection_start[3];
+    ray_start(Ron, reflection, reflection_start);
+    Hit newricochet = shoot(reflection_start, reflection, newbest_t, newbest_object, scene);
+
+    newbest_t = newricochet.t;
+    newbest_object = newricochet.object;
+
+    Real Roprime[3] = {0,0,0};
+    v3_scale(Rd, 0.01, Roprime);
+    v3_add(Roprime, Ron, Roprime);
+
+    //the reflection is always shot since whether it hits something decides if it is blended in, but it is
+    //only shaded if it can carry enough of the pixel's color
+    Real reflected_color[3] = {0,0,0};
+    if(reflected_scale > 0)
+    {
+        shade(newbest_t, newbest_object, scene, Roprime, reflection, NULL, level+1, weight*kr*reflected_scale, path*2, reflected_color);
+        v3_scale(reflected_color, reflected_scale, reflected_color);
+    }
+
+    Real refracted_color[3] = {0,0,0};
+    if(refracted_scale > 0)
+    {
+        Real refnewbest_t = INFINITY; //find the minimum best t intersection of any object
+        int refnewbest_object = -1; //keep track of the corresponding object's index
+        ray_stats.refraction += 1;
+        Real refraction_start[3];
+        ray_start(Ron, refraction, refraction_start);
+        Hit refnewricochet = shoot(refraction_start, refraction, refnewbest_t, refnewbest_object, scene);
+
+        refnewbest_t = refnewricochet.t;
+        refnewbest_object = refnewricochet.object;
+
+        shade(refnewbest_t, refnewbest_object, scene, refraction_start, refraction, NULL, level+1, weight*kt*refracted_scale, path*2+1, refracted_color);
+        v3_scale(refracted_color, refracted_scale, refracted_color);
+    }
+
+    if(newbest_t != INFINITY)
+    {
+        //sum of the different I values
+        color[0] = (1-kr-kt)*color[0]+kr*reflected_color[0]+kt*refracted_color[0];//+kr*shade(recursive call to shade the reflection vector)+kt*shade(recursive call to shade the refraction vector)
+        color[1] = (1-kr-kt)*color[1]+kr*reflected_color[1]+kt*refracted_color[1];
+        color[2] = (1-kr-kt)*color[2]+kr*reflected_color[2]+kt*refracted_color[2];
+    }
+}
+
+
+//this function stores the color of the primary ray through pixel (x, y), which hit best_object best_t along it,
+//into the pixel buffer.  While anti-aliasing, the first sample of each pixel is also kept for comparing with its neighbors.
+void store_color(RenderJob* job, int x, int y, Real best_t, int best_object, Real* color)
+{
+    Pixel temporary;
+    if (best_t > 0 && best_t != INFINITY) //if the intersection is in the viewplane and isn't infinity, store its object's color into the buffer
+    {
+        //at the correct x,y location
+        temporary.r = (int)(clamp(color[0])*255);
+        temporary.g = (int)(clamp(color[1])*255);
+        temporary.b = (int)(clamp(color[2])*255);
+    }
+    else //no point of intersection was found for any object at the given x,y so put black into that x,y pixel into the buffer
+    {
+        temporary.r = 0;
+        temporary.g = 0;
+        temporary.b = 0;
+        color[0] = 0;
+        color[1] = 0;
+        color[2] = 0;
+    }
+    if (job->hdr != NULL)
+    {
+        float* out = &job->hdr[((pheight-1-y)*pwidth + x)*3];
+        out[0] = (float)color[0];
+        out[1] = (float)color[1];
+        out[2] = (float)color[2];
+    }
+    if (job->samples != NULL && !job->refine)
+    {
+        Sample* sample = &job->samples[y*pwidth + x];
+        v3_scale(color, 1.0, sample->color);
+        sample->t = best_t;
+        sample->object = best_object;
+    }
+    job->data[(pheight-1-y)*pwidth + x] = temporary; //the buffer is top row first
+}
+
+//this function returns the index in the full frame of the job's pixel (x, y).  Random numbers are seeded with it, so the
+//pixels of a --region come out exactly as they do in a render of the whole frame.
+static inline unsigned int frame_pixel(RenderJob* job, int x, int y)
+{
+    return (x + job->originX) + (y + job->originY)*job->frameWidth;
+}
+
+//this function stores the primary hit of pixel (x, y) into the job's hit buffer along with the surface normal there,
+//and returns the normal
+Real* record_hit(RenderJob* job, int x, int y, Real* Rd, Real best_t, int best_object)
+{
+    PrimaryHit* hit = &job->hits[y*pwidth + x];
+    hit->t = best_t;
+    hit->object = best_object;
+    hit->normal[0] = 0;
+    hit->normal[1] = 0;
+    hit->normal[2] = 0;
+    if (best_object != -1)
+    {
+        //Ron = best_t * Rd + Ro, worked out exactly as shade_direct() does
+        Real Ro[3] = {0, 0, 0};
+        Real Ron[3] = {0, 0, 0};
+        v3_scale(Rd, best_t, Ron);
+        v3_add(Ron, Ro, Ron);
+        surface_normal(job->scene, best_object, Ron, hit->normal);
+    }
+    return hit->normal;
+}
+
+//this function shades the primary ray through pixel (x, y), whose closest hit has already been found,
+//and stores the resulting color into the pixel buffer.  normal is the surface normal at the hit, or NULL if it isn't known.
+void shade_pixel(RenderJob* job, int x, int y, Real* Rd, Real best_t, int best_object, Real* normal)
+{
+    Real Ro[3] = {0, 0, 0};
+    Real color[3] = {0,0,0}; //ambient lighting is 0
+    if (job->deferred == 1) //the hit is only stored for now, misses are already done
+    {
+        GBufferTexel* texel = &job->gbuffer[y*pwidth + x];
+        texel->t = best_t;
+        texel->object = best_object;
+        if (best_object == -1)
+        {
+            if (collect_stats) ray_stats.depth[0] += 1;
+            store_color(job, x, y, best_t, best_object, color);
+            return;
+        }
+        //Ron = best_t * Rd + Ro, worked out exactly as shade_direct() does
+        Real test[3] = {0, 0, 0};
+        v3_scale(Rd, best_t, test);
+        v3_add(test, Ro, texel->position);
+        if (normal != NULL) v3_scale(normal, 1.0, texel->normal);
+        else surface_normal(job->scene, best_object, texel->position, texel->normal);
+        return;
+    }
+    roulette_pixel = frame_pixel(job, x, y);
+    shade(best_t, best_object, job->scene, Ro, Rd, normal, 0, 1, 1, color);
+    store_color(job, x, y, best_t, best_object, color);
+}
+
+//this function calculates the direction Rd of the primary ray through the center of pixel (x, y) of the viewplane
+void primary_direction(RenderJob* job, int x, int y, Real* Rd)
+{
+    // Rd = normalize(P - Ro)
+    Rd[0] = job->cx - (job->w/2) + job->pixwidth * (x + job->originX + (Real)0.5);
+    Rd[1] = job->cy - (job->h/2) + job->pixheight * (y + job->originY + (Real)0.5);
+    Rd[2] = 1;
+    normalize(Rd);
+}
+
+//this function shoots the primary ray through the center of pixel (x, y) of the viewplane, shades whatever it hits,
+//and stores the resulting color into the pixel buffer.  Each pixel only depends on the scene, so any number of
+//threads can call this at once on different pixels.
+void render_pixel(RenderJob* job, int x, int y)
+{
+    Real Ro[3] = {0, 0, 0};
+    Real Rd[3];
+    primary_direction(job, x, y, Rd);
+
+    if (job->reuseHits) //the hit is already known, only the lighting and the secondary rays are worked out again
+    {
+        PrimaryHit* hit = &job->hits[y*pwidth + x];
+        shade_pixel(job, x, y, Rd, hit->t, hit->object, hit->normal);
+        return;
+    }
+
+    Real best_t = INFINITY; //find the minimum best t intersection of any object
+    int best_object = -1; //keep track of the corresponding object's index
+
+    ray_stats.primary += 1;
+    Hit ricochet = shoot(Ro, Rd, best_t, best_object, job->scene);
+
+    best_t = ricochet.t;
+    best_object = ricochet.object;
+
+    Real* normal = job->hits != NULL ? record_hit(job, x, y, Rd, best_t, best_object) : NULL;
+    shade_pixel(job, x, y, Rd, best_t, best_object, normal);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+//each lane of a packet holds one Real, so a float build traces twice as many rays per packet.  Comparing two
+//packets gives a packet of integers the same size as Real.
+#ifdef SINGLE_PRECISION
+typedef int PacketLane;
+#define packet_sqrt512(v) _mm512_sqrt_ps((__m512)(v))
+#define packet_sqrt256(v) _mm256_sqrt_ps((__m256)(v))
+#define packet_sqrt128(v) _mm_sqrt_ps((__m128)(v))
+#else
+typedef long long PacketLane;
+#define packet_sqrt512(v) _mm512_sqrt_pd((__m512d)(v))
+#define packet_sqrt256(v) _mm256_sqrt_pd((__m256d)(v))
+#define packet_sqrt128(v) _mm_sqrt_pd((__m128d)(v))
+#endif
+
+//the packet kernel is compiled once for each instruction set, widest first
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#define PACKET_WIDTH (64/(int)sizeof(Real))
+#define PACKET_SUFFIX avx512
+typedef Real PacketD_avx512 __attribute__((vector_size(64)));
+typedef PacketLane PacketI_avx512 __attribute__((vector_size(64)));
+#define PacketD PacketD_avx512
+#define PacketI PacketI_avx512
+#define packet_sqrt(v) ((PacketD)packet_sqrt512(v))
+#include "packet.h"
+#undef PACKET_WIDTH
+#undef PACKET_SUFFIX
+#undef PacketD
+#undef PacketI
+#undef packet_sqrt
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#define PACKET_WIDTH (32/(int)sizeof(Real))
+#define PACKET_SUFFIX avx2
+typedef Real PacketD_avx2 __attribute__((vector_size(32)));
+typedef PacketLane PacketI_avx2 __attribute__((vector_size(32)));
+#define PacketD PacketD_avx2
+#define PacketI PacketI_avx2
+#define packet_sqrt(v) ((PacketD)packet_sqrt256(v))
+#include "packet.h"
+#undef PACKET_WIDTH
+#undef PACKET_SUFFIX
+#undef PacketD
+#undef PacketI
+#undef packet_sqrt
+#pragma GCC pop_options
+
+#define PACKET_WIDTH (16/(int)sizeof(Real))
+#define PACKET_SUFFIX sse
+typedef Real PacketD_sse __attribute__((vector_size(16)));
+typedef PacketLane PacketI_sse __attribute__((vector_size(16)));
+#define PacketD PacketD_sse
+#define PacketI PacketI_sse
+#define packet_sqrt(v) ((PacketD)packet_sqrt128(v))
+#include "packet.h"
+#undef PACKET_WIDTH
+#undef PACKET_SUFFIX
+#undef PacketD
+#undef PacketI
+#undef packet_sqrt
+
+//this function picks the widest packet kernel the processor supports, unless the --simd option asked
+//for a particular one.  It returns 0 if the requested instruction set is not available.
+int select_packet_kernel(char* requested)
+{
+    __builtin_cpu_init();
+    int avx512 = __builtin_cpu_supports("avx512f");
+    int avx2 = __builtin_cpu_supports("avx2");
+    if (strcmp(requested, "off") == 0)
+    {
+        packet_width = 1;
+        return 1;
+    }
+    if ((strcmp(requested, "auto") == 0 && avx512) || strcmp(requested, "avx512") == 0)
+    {
+        if (!avx512) return 0;
+        trace_packet = trace_packet_avx512;
+        packet_width = 64/(int)sizeof(Real);
+        strcpy(packet_kernel, "avx512");
+    }
+    else if ((strcmp(requested, "auto") == 0 && avx2) || strcmp(requested, "avx2") == 0)
+    {
+        if (!avx2) return 0;
+        trace_packet = trace_packet_avx2;
+        packet_width = 32/(int)sizeof(Real);
+        strcpy(packet_kernel, "avx2");
+    }
+    else if (strcmp(requested, "auto") == 0 || strcmp(requested, "sse") == 0)
+    {
+        trace_packet = trace_packet_sse;
+        packet_width = 16/(int)sizeof(Real);
+        strcpy(packet_kernel, "sse");
+    }
+    else return 0;
+    return 1;
+}
+#else
+//packets are only implemented for x86 vector units, other processors always use the scalar path
+int select_packet_kernel(char* requested)
+{
+    packet_width = 1;
+    return strcmp(requested, "auto") == 0 || strcmp(requested, "off") == 0;
+}
+#endif
+
+//this function renders the pixels (x, y) to (x+count-1, y) with one packet of primary rays,
+//then shades each ray that belongs to the image on its own
+void render_packet(RenderJob* job, int x, int y, int count)
+{
+    Real Rd[MAX_PACKET*3];
+    Real best_t[MAX_PACKET];
+    int best_object[MAX_PACKET];
+    trace_packet(job, x, y, Rd, best_t, best_object);
+    ray_stats.primary += count; //lanes past the right edge of the image only repeat a pixel, so they aren't counted
+    int k;
+    for (k = 0; k < count; k += 1)
+    {
+        if (collect_stats)
+        {
+            if (best_object[k] != -1) ray_stats.hits += 1;
+            else ray_stats.misses += 1;
+        }
+#ifdef DEBUG
+        //check the packet against the scalar path
+        Real Ro[3] = {0, 0, 0};
+        Hit ricochet = shoot(Ro, &Rd[k*3], INFINITY, -1, job->scene);
+        if (ricochet.object != best_object[k] ||
+                (best_t[k] != INFINITY && fabs(ricochet.t - best_t[k]) > PACKET_TOLERANCE * best_t[k]))
+        {
+            printf("packet mismatch at %d %d: t %.17g vs %.17g, object %d vs %d\n", x + k, y,
+                   best_t[k], ricochet.t, best_object[k], ricochet.object);
+        }
+#endif
+        Real* normal = job->hits != NULL ? record_hit(job, x + k, y, &Rd[k*3], best_t[k], best_object[k]) : NULL;
+        shade_pixel(job, x + k, y, &Rd[k*3], best_t[k], best_object[k], normal);
+    }
+}
+
+//this function renders the pixels from (x0, y0) up to (x1, y1) with the wavefront engine.  Instead of shading each
+//pixel's tree of rays depth first, the rays are processed one level at a time: every ray of a level is intersected,
+//then every one is shaded, which adds the reflections and refractions of the next level to the end of the ray array.
+//Once no rays are left the colors are combined from the deepest rays back up, exactly as shade() combines them.
+void render_wavefront(RenderJob* job, int x0, int y0, int x1, int y1)
+{
+    Scene* scene = job->scene;
+    int count = 0;
+    int x, y, i, k;
+
+    //generate the primary rays, tracing them in packets right away when a packet kernel is in use
+    for (y = y0; y < y1; y += 1)
+    {
+        for (x = x0; x < x1; x += 1)
+        {
+            wave_rays = grow_array(wave_rays, count, &wave_capacity, sizeof(WaveRay));
+            WaveRay* ray = &wave_rays[count++];
+            memset(ray, 0, sizeof(WaveRay));
+            primary_direction(job, x, y, ray->Rd);
+            ray->t = INFINITY;
+            ray->object = -1;
+            ray->pixel = x + y*pwidth;
+            ray->children = -1;
+            ray->path = 1;
+            ray->weight = 1;
+            ray->scale = 1;
+            if (job->reuseHits)
+            {
+                ray->t = job->hits[ray->pixel].t;
+                ray->object = job->hits[ray->pixel].object;
+            }
+        }
+        if (packet_width > 1 && !job->reuseHits)
+        {
+            for (x = x0; x < x1; x += packet_width)
+            {
+                Real Rd[MAX_PACKET*3];
+                Real best_t[MAX_PACKET];
+                int best_object[MAX_PACKET];
+                trace_packet(job, x, y, Rd, best_t, best_object);
+                for (k = 0; k < packet_width && x + k < x1; k += 1)
+                {
+                    WaveRay* ray = &wave_rays[count - (x1 - x) + k];
+                    ray->t = best_t[k];
+                    ray->object = best_object[k];
+                }
+            }
+        }
+    }
+    if (!job->reuseHits) ray_stats.primary += count;
+
+    int start = 0;
+    int end = count;
+    while (start < end)
+    {
+        //intersect every ray of the level
+        if (start == 0 && job->reuseHits)
+        {
+            //the primary hits came from the cache
+        }
+        else if (start > 0 || packet_width == 1)
+        {
+            for (i = start; i < end; i += 1)
+            {
+                if (wave_rays[i].scale == 0 && (wave_rays[i].path & 1)) continue; //cut refractions aren't shot at all
+                Hit hit = shoot(wave_rays[i].Ro, wave_rays[i].Rd, INFINITY, -1, scene);
+                wave_rays[i].t = hit.t;
+                wave_rays[i].object = hit.object;
+            }
+        }
+        else if (collect_stats) //the packets have already intersected the primary rays
+        {
+            for (i = start; i < end; i += 1)
+            {
+                if (wave_rays[i].object != -1) ray_stats.hits += 1;
+                else ray_stats.misses += 1;
+            }
+        }
+
+        //shade every ray of the level, queueing its reflection and refraction for the next one
+        for (i = start; i < end; i += 1)
+        {
+            WaveRay* ray = &wave_rays[i];
+            Real* normal = NULL; //the normals of primary hits are kept for the hit cache
+            if (ray->level == 0 && job->hits != NULL)
+            {
+                if (job->reuseHits) normal = job->hits[ray->pixel].normal;
+                else normal = record_hit(job, ray->pixel % pwidth, ray->pixel / pwidth, ray->Rd, ray->t, ray->object);
+            }
+            if (ray->scale == 0) continue; //cut rays stay black
+            if (collect_stats) ray_stats.depth[ray->level] += 1;
+            if (ray->level > MAX_RECURSION || ray->object == -1) continue; //the base case and misses stay black
+
+            Real Ron[3] = {0, 0, 0};
+            Real n[3] = {0, 0, 0};
+            Real reflection[3] = {0,0,0};
+            Real refraction[3] = {0,0,0};
+            shade_direct(ray->t, ray->object, scene, ray->shadeRo, ray->Rd, normal, Ron, n, ray->color);
+            if (!secondary_rays(ray->object, scene, n, ray->Rd, reflection, refraction)) continue;
+
+            wave_rays = grow_array(wave_rays, count + 1, &wave_capacity, sizeof(WaveRay));
+            ray = &wave_rays[i]; //the array may have moved
+            ray->children = count;
+            WaveRay* child = &wave_rays[count];
+            memset(child, 0, sizeof(WaveRay)*2);
+            Real kr = scene->materials[ray->object].reflectivity;
+            Real kt = scene->materials[ray->object].refractivity;
+            roulette_pixel = frame_pixel(job, ray->pixel % pwidth, ray->pixel / pwidth);
+            child[0].scale = follow_weight(ray->weight*kr, ray->level+1, ray->path*2);
+            child[1].scale = follow_weight(ray->weight*kt, ray->level+1, ray->path*2+1);
+            child[0].weight = ray->weight*kr*child[0].scale;
+            child[1].weight = ray->weight*kt*child[1].scale;
+            ray_start(Ron, reflection, child[0].Ro);
+            v3_scale(ray->Rd, 0.01, child[0].shadeRo);
+            v3_add(child[0].shadeRo, Ron, child[0].shadeRo);
+            v3_scale(reflection, 1.0, child[0].Rd);
+            ray_start(Ron, refraction, child[1].Ro);
+            v3_scale(child[1].Ro, 1.0, child[1].shadeRo);
+            v3_scale(refraction, 1.0, child[1].Rd);
+            for (k = 0; k < 2; k += 1)
+            {
+                child[k].level = ray->level + 1;
+                child[k].pixel = ray->pixel;
+                child[k].path = ray->path*2 + k;
+                child[k].children = -1;
+                child[k].t = INFINITY;
+                child[k].object = -1;
+            }
+            count += 2;
+            ray_stats.reflection += 1;
+            if (child[1].scale > 0) ray_stats.refraction += 1;
+        }
+        start = end;
+        end = count;
+    }
+
+    //combine each ray's color with its reflection's and refraction's, children always come after their parent
+    for (i = count - 1; i >= 0; i -= 1)
+    {
+        WaveRay* ray = &wave_rays[i];
+        if (ray->children == -1) continue;
+        WaveRay* reflected = &wave_rays[ray->children];
+        WaveRay* refracted = &wave_rays[ray->children + 1];
+        v3_scale(reflected->color, reflected->scale, reflected->color);
+        v3_scale(refracted->color, refracted->scale, refracted->color);
+        if (reflected->t != INFINITY)
+        {
+            Real kr = scene->materials[ray->object].reflectivity;
+            Real kt = scene->materials[ray->object].refractivity;
+            for (k = 0; k < 3; k += 1)
+            {
+                ray->color[k] = (1-kr-kt)*ray->color[k]+kr*reflected->color[k]+kt*refracted->color[k];
+            }
+        }
+    }
+
+    for (i = 0; i < (x1 - x0) * (y1 - y0); i += 1)
+    {
+        store_color(job, wave_rays[i].pixel % pwidth, wave_rays[i].pixel / pwidth, wave_rays[i].t, wave_rays[i].object, wave_rays[i].color);
+    }
+}
+
+//this function copies the color stored for pixel (x, y) over the step by step block of pixels below and to the
+//right of it, so that a progressive pass looks like a complete image until the later passes fill the block in
+void fill_block(RenderJob* job, int x, int y, int step)
+{
+    Pixel* source = &job->data[(pheight-1-y)*pwidth + x];
+    int bx, by;
+    for (by = y; by < y + step && by < pheight; by += 1)
+    {
+        for (bx = x; bx < x + step && bx < pwidth; bx += 1)
+        {
+            job->data[(pheight-1-by)*pwidth + bx] = *source;
+            if (job->hdr != NULL)
+            {
+                memcpy(&job->hdr[((pheight-1-by)*pwidth + bx)*3], &job->hdr[((pheight-1-y)*pwidth + x)*3], sizeof(float)*3);
+            }
+        }
+    }
+}
+
+//this function renders the pixels of the given tile that belong to the progressive pass with the given step: those on
+//the step by step grid that weren't already on the grid of the pass before it.  Each one is rendered exactly as in a
+//normal render and then fills its block until a finer pass gets there.
+void render_tile_pass(RenderJob* job, int x0, int y0, int x1, int y1, int step)
+{
+    int y, x;
+    for (y = y0; y < y1; y += 1)
+    {
+        if (y % step != 0) continue;
+        for (x = x0; x < x1; x += 1)
+        {
+            if (x % step != 0) continue;
+            if (step < PROGRESSIVE_STEP && x % (step*2) == 0 && y % (step*2) == 0) continue; //rendered by an earlier pass
+            render_pixel(job, x, y);
+            if (step > 1) fill_block(job, x, y, step);
+        }
+    }
+}
+
+//this function tells whether the first samples of two neighboring pixels differ enough that they need more samples:
+//they hit different objects, one of their color channels differs by more than aa_threshold, or their depths differ by
+//more than AA_DEPTH of the nearer one
+int samples_differ(Sample* a, Sample* b)
+{
+    if (a->object != b->object) return 1;
+    int k;
+    for (k = 0; k < 3; k += 1)
+    {
+        if (fabs(clamp(a->color[k]) - clamp(b->color[k])) > aa_threshold) return 1;
+    }
+    if (a->t != INFINITY && b->t != INFINITY && fabs(a->t - b->t) > AA_DEPTH * (a->t < b->t ? a->t : b->t)) return 1;
+    return 0;
+}
+
+//this function anti-aliases the pixels of the given tile whose first sample differs from one of its four neighbors'.
+//Such a pixel is split into an n by n grid, where 1 + n*n is at most aa_samples, and it is given the average color
+//of its first sample and one sample at a random point in each cell of the grid.
+void refine_tile(RenderJob* job, int x0, int y0, int x1, int y1)
+{
+    int n = (int)sqrt(aa_samples - 1);
+    int x, y, sx, sy;
+    //the border around a region is only there for its first samples, it is cropped off without being refined
+    if (x0 < job->keepX0) x0 = job->keepX0;
+    if (y0 < job->keepY0) y0 = job->keepY0;
+    if (x1 > job->keepX1) x1 = job->keepX1;
+    if (y1 > job->keepY1) y1 = job->keepY1;
+    for (y = y0; y < y1; y += 1)
+    {
+        for (x = x0; x < x1; x += 1)
+        {
+            Sample* sample = &job->samples[y*pwidth + x];
+            ray_stats.samples += 1;
+            if (!((x > 0 && samples_differ(sample, sample - 1)) ||
+                    (x < pwidth - 1 && samples_differ(sample, sample + 1)) ||
+                    (y > 0 && samples_differ(sample, sample - pwidth)) ||
+                    (y < pheight - 1 && samples_differ(sample, sample + pwidth)))) continue;
+
+            Real sum[3] = {sample->color[0], sample->color[1], sample->color[2]};
+            Real nearest = sample->t;
+            roulette_pixel = frame_pixel(job, x, y);
+            for (sy = 0; sy < n; sy += 1)
+            {
+                for (sx = 0; sx < n; sx += 1)
+                {
+                    //the random offsets come from the same hash as russian roulette, on paths no ray tree uses
+                    unsigned int cell = (sy*n + sx + 1) << 16;
+                    Real Ro[3] = {0, 0, 0};
+                    Real Rd[3] =
+                    {
+                        job->cx - (job->w/2) + job->pixwidth * (x + job->originX + (sx + roulette_random(roulette_pixel, cell)) / n),
+                        job->cy - (job->h/2) + job->pixheight * (y + job->originY + (sy + roulette_random(roulette_pixel, cell + 1)) / n),
+                        1
+                    };
+                    normalize(Rd);
+                    ray_stats.primary += 1;
+                    Hit hit = shoot(Ro, Rd, INFINITY, -1, job->scene);
+                    Real color[3];
+                    shade(hit.t, hit.object, job->scene, Ro, Rd, NULL, 0, 1, 1, color);
+                    v3_add(sum, color, sum);
+                    if (hit.t < nearest) nearest = hit.t;
+                }
+            }
+            v3_scale(sum, 1.0 / (1 + n*n), sum);
+            store_color(job, x, y, nearest, sample->object, sum);
+            ray_stats.samples += n*n;
+            ray_stats.refinedPixels += 1;
+        }
+    }
+}
+
+//this function shades the given chunk of the G-buffer's texels, which are grouped by material.  Each run of texels with
+//the same material is lit one light at a time, so the lighting loop streams through the run's texels with the same
+//material and light, and then each texel's reflection and refraction are blended in exactly as shade() does.
+void shade_chunk(RenderJob* job, int chunk)
+{
+    Scene* scene = job->scene;
+    int first = chunk*DEFERRED_CHUNK;
+    int last = first + DEFERRED_CHUNK < job->numOfOrdered ? first + DEFERRED_CHUNK : job->numOfOrdered;
+    Real Rd[DEFERRED_CHUNK][3];
+    Real v[DEFERRED_CHUNK][3];
+    Real color[DEFERRED_CHUNK][3];
+    int i, j, p;
+    for (i = first; i < last; i = j)
+    {
+        int object = job->gbuffer[job->order[i]].object;
+        for (j = i; j < last && job->gbuffer[job->order[j]].object == object; j += 1)
+        {
+            int pixel = job->order[j];
+            primary_direction(job, pixel % pwidth, pixel / pwidth, Rd[j - first]);
+            v3_scale(Rd[j - first], -1.0, v[j - first]); //V = -Rd;
+            color[j - first][0] = 0; //ambient lighting is 0
+            color[j - first][1] = 0;
+            color[j - first][2] = 0;
+        }
+
+        Material* material = &scene->materials[object];
+        int l;
+        for (l = 0; l < scene->numOfLights; l += 1)
+        {
+            CompiledLight* light = &scene->compiledLights[l];
+            for (p = i; p < j; p += 1)
+            {
+                GBufferTexel* texel = &job->gbuffer[job->order[p]];
+                add_light(scene, material, light, texel->position, texel->normal, v[p - first], color[p - first]);
+            }
+        }
+
+        for (p = i; p < j; p += 1)
+        {
+            int pixel = job->order[p];
+            GBufferTexel* texel = &job->gbuffer[pixel];
+            if (collect_stats) ray_stats.depth[0] += 1;
+            roulette_pixel = frame_pixel(job, pixel % pwidth, pixel / pwidth);
+            shade_secondary(object, scene, texel->position, texel->normal, Rd[p - first], 0, 1, 1, color[p - first]);
+            store_color(job, pixel % pwidth, pixel / pwidth, texel->t, object, color[p - first]);
+        }
+    }
+}
+
+//this function renders every pixel of the given tile
+void render_tile(RenderJob* job, int tile)
+{
+    int x0 = (tile % job->tilesX) * TILE_SIZE;
+    int y0 = (tile / job->tilesX) * TILE_SIZE;
+    int x1 = x0 + TILE_SIZE < pwidth ? x0 + TILE_SIZE : pwidth;
+    int y1 = y0 + TILE_SIZE < pheight ? y0 + TILE_SIZE : pheight;
+    int y, x;
+    if (job->deferred == 2) //the shading pass hands out chunks of texels rather than tiles
+    {
+        shade_chunk(job, tile);
+        return;
+    }
+    if (job->refine)
+    {
+        refine_tile(job, x0, y0, x1, y1);
+        return;
+    }
+    if (job->step > 0)
+    {
+        render_tile_pass(job, x0, y0, x1, y1, job->step);
+        return;
+    }
+    if (wavefront)
+    {
+        render_wavefront(job, x0, y0, x1, y1);
+        return;
+    }
+    for (y = y0; y < y1; y += 1)
+    {
+        if (packet_width > 1 && !job->reuseHits)
+        {
+            for (x = x0; x < x1; x += packet_width)
+            {
+                render_packet(job, x, y, x1 - x < packet_width ? x1 - x : packet_width);
+            }
+            continue;
+        }
+        for (x = x0; x < x1; x += 1)
+        {
+            render_pixel(job, x, y);
+        }
+    }
+}
+
+//this function takes the next tile from the front of a worker's own queue.
+//It returns -1 once the queue is empty.
+int take_tile(TileQueue* queue)
+{
+    unsigned long long range = atomic_load(&queue->range);
+    while (1)
+    {
+        unsigned int next = (unsigned int)range;
+        unsigned int end = (unsigned int)(range >> 32);
+        if (next >= end) return -1;
+        unsigned long long taken = ((unsigned long long)end << 32) | (next + 1);
+        if (atomic_compare_exchange_weak(&queue->range, &range, taken)) return (int)next;
+    }
+}
+
+//this function steals a tile from the back of another worker's queue so that workers
+//which finish early keep busy.  It returns -1 if the queue has nothing left to steal.
+int steal_tile(TileQueue* queue)
+{
+    unsigned long long range = atomic_load(&queue->range);
+    while (1)
+    {
+        unsigned int next = (unsigned int)range;
+        unsigned int end = (unsigned int)(range >> 32);
+        if (next >= end) return -1;
+        unsigned long long stolen = ((unsigned long long)(end - 1) << 32) | next;
+        if (atomic_compare_exchange_weak(&queue->range, &range, stolen)) return (int)(end - 1);
+    }
+}
+
+//this function is the body of each render thread.  It renders the tiles in its own queue and
+//then steals from the other workers' queues until every queue is empty.
+void* render_worker(void* arg)
+{
+    Worker* worker = (Worker*)arg;
+    RenderJob* job = worker->job;
+    int tile;
+    memset(&ray_stats, 0, sizeof(RayStats));
+    while ((tile = take_tile(&job->queues[worker->id])) != -1)
+    {
+        render_tile(job, tile);
+    }
+    int k;
+    for (k = 1; k < job->numOfWorkers; k += 1)
+    {
+        TileQueue* victim = &job->queues[(worker->id + k) % job->numOfWorkers];
+        while ((tile = steal_tile(victim)) != -1)
+        {
+            render_tile(job, tile);
+        }
+    }
+    worker->stats = ray_stats;
+    return NULL;
+}
+
+//this function adds one thread's counters into the total
+void merge_stats(RayStats* total, RayStats* part)
+{
+    total->primary += part->primary;
+    total->shadow += part->shadow;
+    total->reflection += part->reflection;
+    total->refraction += part->refraction;
+    total->sphereTests += part->sphereTests;
+    total->planeTests += part->planeTests;
+    total->hits += part->hits;
+    total->misses += part->misses;
+    int i;
+    for (i = 0; i < MAX_RECURSION+2; i += 1)
+    {
+        total->depth[i] += part->depth[i];
+    }
+    total->spotlightSkipped += part->spotlightSkipped;
+    total->lightsCulled += part->lightsCulled;
+    total->samples += part->samples;
+    total->refinedPixels += part->refinedPixels;
+}
+
+//this function returns the number of rays of every kind that were cast
+unsigned long long total_rays(RayStats* stats)
+{
+    return stats->primary + stats->shadow + stats->reflection + stats->refraction;
+}
+
+//this function prints the counters of a render for --stats
+void print_stats(RayStats* stats)
+{
+    printf("\nRay statistics:\n");
+    printf("  primary rays    : %llu\n", stats->primary);
+    printf("  shadow rays     : %llu\n", stats->shadow);
+    printf("  reflection rays : %llu\n", stats->reflection);
+    printf("  refraction rays : %llu\n", stats->refraction);
+    printf("  total rays      : %llu\n", total_rays(stats));
+    printf("  sphere tests    : %llu\n", stats->sphereTests);
+    printf("  plane tests     : %llu\n", stats->planeTests);
+    printf("  hits / misses   : %llu / %llu\n", stats->hits, stats->misses);
+    printf("  spotlight skips : %llu\n", stats->spotlightSkipped);
+    printf("  lights culled   : %llu\n", stats->lightsCulled);
+    printf("  shade() calls by recursion depth:\n");
+    int i;
+    for (i = 0; i < MAX_RECURSION+2; i += 1)
+    {
+        if (stats->depth[i] > 0) printf("    %d: %llu\n", i, stats->depth[i]);
+    }
+}
+
+//this function is the body of each render thread kept by the pool.  It sleeps until render_job() hands out a job,
+//renders its share of the job if the job has work for that many threads, and goes back to sleep.
+void* pool_thread(void* arg)
+{
+    Worker* worker = (Worker*)arg;
+    unsigned int seen = 0;
+    pthread_mutex_lock(&pool_lock);
+    while (1)
+    {
+        while (pool_generation == seen && !pool_quit) pthread_cond_wait(&pool_wake, &pool_lock);
+        if (pool_quit) break;
+        seen = pool_generation;
+        if (worker->id >= pool_job->numOfWorkers) continue;
+        worker->job = pool_job;
+        pthread_mutex_unlock(&pool_lock);
+        render_worker(worker);
+        pthread_mutex_lock(&pool_lock);
+        pool_busy -= 1;
+        if (pool_busy == 0) pthread_cond_signal(&pool_idle);
+    }
+    pthread_mutex_unlock(&pool_lock);
+    free(wave_rays);
+    return NULL;
+}
+
+//this function starts the nthreads-1 render threads that help the calling thread with every job
+void start_render_threads(void)
+{
+    int i;
+    pool_size = nthreads;
+    pool_threads = malloc(sizeof(pthread_t)*pool_size);
+    pool_workers = malloc(sizeof(Worker)*pool_size);
+    for (i = 0; i < pool_size; i += 1)
+    {
+        pool_workers[i].id = i;
+        if (i == 0) continue; //the calling thread does the first worker's share itself
+        if (pthread_create(&pool_threads[i], NULL, pool_thread, &pool_workers[i]) != 0)
+        {
+            fprintf(stderr, "Error: Could not create render thread %d.\n", i);
+            exit(1);
+        }
+    }
+}
+
+//this function stops the render threads and frees what they, and the calling thread, kept between jobs
+void stop_render_threads(void)
+{
+    int i;
+    if (pool_size == 0) return;
+    pthread_mutex_lock(&pool_lock);
+    pool_quit = 1;
+    pthread_cond_broadcast(&pool_wake);
+    pthread_mutex_unlock(&pool_lock);
+    for (i = 1; i < pool_size; i += 1)
+    {
+        pthread_join(pool_threads[i], NULL);
+    }
+    free(pool_workers);
+    free(pool_threads);
+    pool_size = 0;
+    free(wave_rays);
+    wave_rays = NULL;
+    wave_capacity = 0;
+}
+
+//this function renders the job's image, or its current progressive pass, by dealing the tiles out to nthreads workers:
+//the calling thread and the pool's render threads, which are started by the first job.  The workers' counters are
+//added into stats.
+void render_job(RenderJob* job, RayStats* stats)
+{
+    int i;
+    //deal the tiles out to the workers in contiguous runs, the first workers take one extra tile if they don't divide evenly
+    job->queues = malloc(sizeof(TileQueue)*job->numOfWorkers);
+    int start = 0;
+    for (i = 0; i < job->numOfWorkers; i += 1)
+    {
+        int count = job->numOfTiles / job->numOfWorkers + (i < job->numOfTiles % job->numOfWorkers ? 1 : 0);
+        atomic_init(&job->queues[i].range, ((unsigned long long)(start + count) << 32) | start);
+        start += count;
+    }
+
+    if (pool_size == 0) start_render_threads();
+    pthread_mutex_lock(&pool_lock);
+    pool_job = job;
+    pool_busy = job->numOfWorkers - 1;
+    pool_generation += 1;
+    pthread_cond_broadcast(&pool_wake);
+    pthread_mutex_unlock(&pool_lock);
+    pool_workers[0].job = job;
+    render_worker(&pool_workers[0]);
+    pthread_mutex_lock(&pool_lock);
+    while (pool_busy > 0) pthread_cond_wait(&pool_idle, &pool_lock);
+    pthread_mutex_unlock(&pool_lock);
+    for (i = 0; i < job->numOfWorkers; i += 1)
+    {
+        merge_stats(stats, &pool_workers[i].stats);
+    }
+    free(job->queues);
+}
+
+//this function opens the output file for an image to be written into
+void open_output(char* filename)
+{
+    outputfp = fopen(filename, "wb"); //open output to write to binary
+    if (outputfp == 0)
+    {
+        fprintf(stderr, "Error: Output file \"%s\" could not be opened.\n", filename);
+        exit(1); //if the file cannot be opened, exit the program
+    }
+    setvbuf(outputfp, NULL, _IOFBF, OUTPUT_BLOCK); //write the image out in large blocks
+    maxcv = 255;
+}
+
+//this function closes the output file once the image is written, exiting the program if the writer reported a failure
+void close_output(int successfulWrite)
+{
+    if(successfulWrite != 1)
+    {
+        fprintf(stderr, "Error: Failed to properly write to output image file.\n");
+        exit(1);
+    }
+    fclose(outputfp); //close the output file
+}
+
+//this function opens the output file and writes the rendered image into it in the chosen format
+void write_output(char* filename, Pixel* data, float* hdr)
+{
+    open_output(filename);
+    printf("writing to image file...\n");
+    close_output(write_image(data, hdr)); //write the pixel buffer to the image file
+}
+
+//this function writes the G-buffer out for debugging, as three pfm images named after gbuffer_dump: the position hit by
+//each pixel, the surface normal there, and the index of the object hit (-1 for a miss) in every channel
+void dump_gbuffer(RenderJob* job)
+{
+    char* names[3] = {"position", "normal", "material"};
+    char filename[4096];
+    float* channels = malloc(sizeof(float)*pwidth*pheight*3);
+    OutputFormat* format = output_format;
+    output_format = find_output_format("pfm", NULL);
+    int i, x, y, k;
+    for (i = 0; i < 3; i += 1)
+    {
+        for (y = 0; y < pheight; y += 1)
+        {
+            for (x = 0; x < pwidth; x += 1)
+            {
+                GBufferTexel* texel = &job->gbuffer[y*pwidth + x];
+                float* out = &channels[((pheight-1-y)*pwidth + x)*3]; //laid out like the hdr buffer, top row first
+                for (k = 0; k < 3; k += 1)
+                {
+                    if (i == 2) out[k] = (float)texel->object;
+                    else if (texel->object == -1) out[k] = 0;
+                    else out[k] = (float)(i == 0 ? texel->position[k] : texel->normal[k]);
+                }
+            }
+        }
+        snprintf(filename, sizeof(filename), "%s.%s.pfm", gbuffer_dump, names[i]);
+        write_output(filename, job->data, channels);
+    }
+    output_format = format;
+    free(channels);
+}
+
+//this function renders the job's image in two passes.  The first finds the primary hit of every pixel and stores it
+//into the G-buffer, and the second groups the pixels by the material they hit and shades them a chunk at a time.
+//Both passes are spread over the render threads, and the image is identical to one shaded as its pixels are hit.
+void render_deferred(RenderJob* job, RayStats* stats)
+{
+    Scene* scene = job->scene;
+    int i;
+    job->gbuffer = malloc(sizeof(GBufferTexel)*pwidth*pheight);
+    job->deferred = 1;
+    render_job(job, stats);
+    if (gbuffer_dump != NULL) dump_gbuffer(job);
+
+    //group the pixels that hit something by material with a counting sort, keeping each material's pixels in image order
+    int* start = calloc(scene->numOfObjects + 1, sizeof(int));
+    int materials = 0;
+    for (i = 0; i < pwidth*pheight; i += 1)
+    {
+        if (job->gbuffer[i].object != -1) start[job->gbuffer[i].object + 1] += 1;
+    }
+    for (i = 0; i < scene->numOfObjects; i += 1)
+    {
+        if (start[i+1] > 0) materials += 1;
+        start[i+1] += start[i];
+    }
+    job->numOfOrdered = start[scene->numOfObjects];
+    job->order = malloc(sizeof(int)*(job->numOfOrdered + 1));
+    for (i = 0; i < pwidth*pheight; i += 1)
+    {
+        if (job->gbuffer[i].object != -1) job->order[start[job->gbuffer[i].object]++] = i;
+    }
+    free(start);
+    if (stream_rows == 0) printf("Deferred shading: %d of %d pixels hit %d materials\n", job->numOfOrdered, pwidth*pheight, materials);
+
+    //the shading pass hands out chunks of the grouped pixels instead of tiles
+    int numOfTiles = job->numOfTiles;
+    int numOfWorkers = job->numOfWorkers;
+    job->deferred = 2;
+    job->numOfTiles = (job->numOfOrdered + DEFERRED_CHUNK - 1) / DEFERRED_CHUNK;
+    job->numOfWorkers = nthreads < job->numOfTiles ? nthreads : job->numOfTiles;
+    if (job->numOfTiles > 0) render_job(job, stats);
+    job->numOfTiles = numOfTiles;
+    job->numOfWorkers = numOfWorkers;
+    job->deferred = 0;
+    free(job->order);
+    free(job->gbuffer);
+    job->order = NULL;
+    job->gbuffer = NULL;
+}
+
+//this function writes the image rendered so far out to the preview file.  It is written to a temporary file first and
+//then renamed over the preview, so anything watching the preview never sees half of an image.
+void write_preview(Pixel* data, float* hdr)
+{
+    char temporary[4096];
+    snprintf(temporary, sizeof(temporary), "%s.part", preview_filename);
+    outputfp = fopen(temporary, "wb");
+    if (outputfp == NULL)
+    {
+        fprintf(stderr, "Error: Preview file \"%s\" could not be opened.\n", temporary);
+        exit(1);
+    }
+    setvbuf(outputfp, NULL, _IOFBF, OUTPUT_BLOCK);
+    maxcv = 255;
+    if (write_image(data, hdr) != 1 || fclose(outputfp) != 0 || rename(temporary, preview_filename) != 0)
+    {
+        fprintf(stderr, "Error: Failed to write preview image \"%s\".\n", preview_filename);
+        exit(1);
+    }
+}
+
+//this function adds the given bytes to a 64 bit FNV-1a hash
+unsigned long long hash_bytes(unsigned long long hash, void* data, size_t length)
+{
+    unsigned char* bytes = (unsigned char*)data;
+    size_t i;
+    for (i = 0; i < length; i += 1)
+    {
+        hash = (hash ^ bytes[i]) * 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+//this function hashes everything the primary hits of a render depend on: the image size and where it lies in the frame,
+//the camera, and the compiled geometry of the scene.  Colors, materials, and lights aren't hashed, so changing them
+//doesn't stale the hit cache.
+unsigned long long hit_cache_hash(RenderJob* job)
+{
+    Scene* scene = job->scene;
+    unsigned long long hash = 0xCBF29CE484222325ULL;
+    int size[9] = {pwidth, pheight, frame_width, frame_height, job->originX, job->originY,
+                   scene->numOfObjects, scene->numOfSpheres, scene->numOfPlanes};
+    Real camera[4] = {job->cx, job->cy, job->w, job->h};
+    hash = hash_bytes(hash, size, sizeof(size));
+    hash = hash_bytes(hash, camera, sizeof(camera));
+    hash = hash_bytes(hash, scene->sphereCenter, sizeof(Real)*3*scene->numOfSpheres);
+    hash = hash_bytes(hash, scene->sphereR2, sizeof(Real)*scene->numOfSpheres);
+    hash = hash_bytes(hash, scene->sphereObject, sizeof(int)*scene->numOfSpheres);
+    hash = hash_bytes(hash, scene->planeNormal, sizeof(Real)*3*scene->numOfPlanes);
+    hash = hash_bytes(hash, scene->planeOffset, sizeof(Real)*scene->numOfPlanes);
+    hash = hash_bytes(hash, scene->planeObject, sizeof(int)*scene->numOfPlanes);
+    return hash;
+}
+
+//this function loads the primary hits stored in the hit cache file into the job's hit buffer.  It returns 1 if they
+//were loaded, and 0 if there is no cache yet or it was written for a different geometry, camera, size, or precision.
+int load_hit_cache(RenderJob* job, unsigned long long hash)
+{
+    FILE* cachefp = fopen(hit_cache_filename, "rb");
+    if (cachefp == NULL) return 0;
+    HitCacheHeader header;
+    size_t count = (size_t)pwidth*pheight;
+    int loaded = fread(&header, sizeof(HitCacheHeader), 1, cachefp) == 1 && memcmp(header.magic, "RTHITS1", 8) == 0 &&
+                 header.hash == hash && header.width == pwidth && header.height == pheight && header.realSize == (int)sizeof(Real) &&
+                 fread(job->hits, sizeof(PrimaryHit), count, cachefp) == count;
+    fclose(cachefp);
+    return loaded;
+}
+
+//this function writes the job's primary hits out to the hit cache file.  It is written to a temporary file first and
+//then renamed over the cache, so an interrupted render never leaves half of a cache behind.
+void save_hit_cache(RenderJob* job, unsigned long long hash)
+{
+    char temporary[4096];
+    snprintf(temporary, sizeof(temporary), "%s.part", hit_cache_filename);
+    FILE* cachefp = fopen(temporary, "wb");
+    if (cachefp == NULL)
+    {
+        fprintf(stderr, "Error: Hit cache file \"%s\" could not be opened.\n", temporary);
+        exit(1);
+    }
+    HitCacheHeader header;
+    memset(&header, 0, sizeof(HitCacheHeader));
+    memcpy(header.magic, "RTHITS1", 8);
+    header.hash = hash;
+    header.width = pwidth;
+    header.height = pheight;
+    header.realSize = sizeof(Real);
+    size_t count = (size_t)pwidth*pheight;
+    if (fwrite(&header, sizeof(HitCacheHeader), 1, cachefp) != 1 || fwrite(job->hits, sizeof(PrimaryHit), count, cachefp) != count ||
+            fclose(cachefp) != 0 || rename(temporary, hit_cache_filename) != 0)
+    {
+        fprintf(stderr, "Error: Failed to write hit cache \"%s\".\n", hit_cache_filename);
+        exit(1);
+    }
+}
+
+//this function lists the arrays of a compiled scene along with their sizes in bytes, in the order that a compiled
+//scene file stores them.  arrays gets the address of each of the scene's pointers so that a loader can set them.
+void scene_sections(Scene* scene, void*** arrays, size_t* sizes)
+{
+    void** a[SCENE_SECTIONS] = {(void**)&scene->objects, (void**)&scene->lights, (void**)&scene->nodes,
+                                (void**)&scene->sphereCenter, (void**)&scene->sphereR2, (void**)&scene->sphereInvRadius,
+                                (void**)&scene->sphereObject, (void**)&scene->planeNormal, (void**)&scene->planeOffset,
+                                (void**)&scene->planeObject, (void**)&scene->materials, (void**)&scene->compiledLights};
+    size_t s[SCENE_SECTIONS] = {sizeof(Object)*scene->numOfObjects, sizeof(Light)*scene->numOfLights, sizeof(BvhNode)*scene->numOfNodes,
+                                sizeof(Real)*3*scene->numOfSpheres, sizeof(Real)*scene->numOfSpheres, sizeof(Real)*scene->numOfSpheres,
+                                sizeof(int)*scene->numOfSpheres, sizeof(Real)*3*scene->numOfPlanes, sizeof(Real)*scene->numOfPlanes,
+                                sizeof(int)*scene->numOfPlanes, sizeof(Material)*scene->numOfObjects, sizeof(CompiledLight)*scene->numOfLights};
+    memcpy(arrays, a, sizeof(a));
+    memcpy(sizes, s, sizeof(s));
+}
+
+//this function rounds a position in a compiled scene file up to the next multiple of SCENE_FILE_ALIGN
+size_t align_section(size_t offset)
+{
+    return (offset + SCENE_FILE_ALIGN - 1) & ~(size_t)(SCENE_FILE_ALIGN - 1);
+}
+
+//this function returns the checksum of a compiled scene file, whose length is a multiple of SCENE_FILE_ALIGN.  It mixes
+//in eight bytes at a time over four independent lanes, so a large scene is checked about as fast as it can be read.
+unsigned long long scene_checksum(void* data, size_t length)
+{
+    unsigned long long* words = (unsigned long long*)data;
+    unsigned long long lane[4] = {0xCBF29CE484222325ULL, 0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL};
+    size_t count = length / sizeof(unsigned long long);
+    size_t i;
+    int k;
+    for (i = 0; i + 4 <= count; i += 4)
+    {
+        for (k = 0; k < 4; k += 1)
+        {
+            lane[k] = (lane[k] ^ words[i+k]) * 0x100000001B3ULL;
+            lane[k] ^= lane[k] >> 29;
+        }
+    }
+    return hash_bytes(0xCBF29CE484222325ULL ^ length, lane, sizeof(lane));
+}
+
+//this function writes a compiled scene out to a compiled scene file, recording the json file it was compiled from so
+//that a stale copy can be noticed.  The arrays are written first, then the file is mapped back to take its checksum,
+//and the finished header goes in last.  Like the hit cache it is written to a temporary file that is renamed over filename.
+void write_compiled_scene(char* filename, Scene* scene, char* source)
+{
+    static char zeros[SCENE_FILE_ALIGN];
+    char temporary[4096];
+    void** arrays[SCENE_SECTIONS];
+    size_t sizes[SCENE_SECTIONS];
+    CompiledSceneHeader header;
+    struct stat info;
+    int k;
+    snprintf(temporary, sizeof(temporary), "%s.part", filename);
+    FILE* scenefp = fopen(temporary, "w+b");
+    if (scenefp == NULL)
+    {
+        fprintf(stderr, "Error: Compiled scene file \"%s\" could not be opened.\n", temporary);
+        exit(1);
+    }
+
+    memset(&header, 0, sizeof(CompiledSceneHeader));
+    memcpy(header.magic, "RTSCENE", 8);
+    header.version = SCENE_FILE_VERSION;
+    header.realSize = sizeof(Real);
+    if (realpath(source, header.source) == NULL) header.source[0] = '\0';
+    if (stat(source, &info) == 0)
+    {
+        header.sourceSize = info.st_size;
+        header.sourceTime = info.st_mtim.tv_sec*1000000000LL + info.st_mtim.tv_nsec;
+    }
+    header.numOfObjects = scene->numOfObjects;
+    header.numOfLights = scene->numOfLights;
+    header.numOfNodes = scene->numOfNodes;
+    header.numOfSpheres = scene->numOfSpheres;
+    header.numOfPlanes = scene->numOfPlanes;
+
+    //lay the arrays out one after another, each padded up to the alignment
+    size_t length = align_section(sizeof(CompiledSceneHeader));
+    int failed = fwrite(&header, sizeof(CompiledSceneHeader), 1, scenefp) != 1 ||
+                 fwrite(zeros, 1, length - sizeof(CompiledSceneHeader), scenefp) != length - sizeof(CompiledSceneHeader);
+    scene_sections(scene, arrays, sizes);
+    for (k = 0; k < SCENE_SECTIONS && !failed; k += 1)
+    {
+        header.offset[k] = length;
+        size_t padding = align_section(sizes[k]) - sizes[k];
+        failed = fwrite(*arrays[k], 1, sizes[k], scenefp) != sizes[k] || fwrite(zeros, 1, padding, scenefp) != padding;
+        length += sizes[k] + padding;
+    }
+    header.length = length;
+
+    //write the header again with the offsets, then checksum the whole file and write the header a last time
+    if (!failed)
+    {
+        failed = fseek(scenefp, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(CompiledSceneHeader), 1, scenefp) != 1 || fflush(scenefp) != 0;
+    }
+    if (!failed)
+    {
+        void* data = mmap(NULL, length, PROT_READ, MAP_SHARED, fileno(scenefp), 0);
+        failed = data == MAP_FAILED;
+        if (!failed)
+        {
+            header.checksum = scene_checksum(data, length);
+            munmap(data, length);
+        }
+    }
+    if (failed || fseek(scenefp, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(CompiledSceneHeader), 1, scenefp) != 1 ||
+            fclose(scenefp) != 0 || rename(temporary, filename) != 0)
+    {
+        fprintf(stderr, "Error: Failed to write compiled scene \"%s\".\n", filename);
+        exit(1);
+    }
+}
+
+//this function maps a compiled scene file written by write_compiled_scene() and points the scene's arrays into it, so
+//nothing is parsed or copied.  The mapping is private, so a batch job's overrides only copy the pages they change.
+//It returns 0 without loading anything if the file isn't a compiled scene, and exits the program with an error if it
+//is one that is corrupt, was written by another version or precision, or was compiled from a different version of
+//the json file it came from.
+int load_compiled_scene(char* filename, Scene* scene)
+{
+    char magic[8];
+    struct stat info;
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1 || fstat(fd, &info) == -1)
+    {
+        fprintf(stderr, "Error: Could not open file \"%s\"\n", filename);
+        exit(1);
+    }
+    if (pread(fd, magic, 8, 0) != 8 || memcmp(magic, "RTSCENE", 8) != 0) //anything else is left to read_scene()
+    {
+        close(fd);
+        return 0;
+    }
+    size_t length = info.st_size;
+    char* data = NULL;
+    if (length >= sizeof(CompiledSceneHeader)) data = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == NULL || data == MAP_FAILED)
+    {
+        fprintf(stderr, "Error: Compiled scene \"%s\" is corrupt.\n", filename);
+        exit(1);
+    }
+    CompiledSceneHeader* header = (CompiledSceneHeader*)data;
+    if (header->version != SCENE_FILE_VERSION || header->realSize != (int)sizeof(Real))
+    {
+        fprintf(stderr, "Error: Compiled scene \"%s\" was written by a different version or precision of the program, compile it again with --compile-scene.\n", filename);
+        exit(1);
+    }
+
+    //the checksum was taken with its own field zeroed, which only copies the header's page of the private mapping
+    unsigned long long checksum = header->checksum;
+    header->checksum = 0;
+    int corrupt = header->length != length || length % SCENE_FILE_ALIGN != 0 || scene_checksum(data, length) != checksum;
+    header->checksum = checksum;
+    if (corrupt || header->numOfObjects < 0 || header->numOfLights < 0 || header->numOfNodes < 1 ||
+            header->numOfSpheres < 0 || header->numOfPlanes < 0)
+    {
+        fprintf(stderr, "Error: Compiled scene \"%s\" is corrupt.\n", filename);
+        exit(1);
+    }
+    if (header->source[0] != '\0' && stat(header->source, &info) == 0 &&
+            (info.st_size != header->sourceSize || info.st_mtim.tv_sec*1000000000LL + info.st_mtim.tv_nsec != header->sourceTime))
+    {
+        fprintf(stderr, "Error: Compiled scene \"%s\" was compiled from a different version of \"%s\", compile it again with --compile-scene.\n", filename, header->source);
+        exit(1);
+    }
+
+    void** arrays[SCENE_SECTIONS];
+    size_t sizes[SCENE_SECTIONS];
+    int k;
+    scene->numOfObjects = header->numOfObjects;
+    scene->numOfLights = header->numOfLights;
+    scene->numOfNodes = header->numOfNodes;
+    scene->numOfSpheres = header->numOfSpheres;
+    scene->numOfPlanes = header->numOfPlanes;
+    scene_sections(scene, arrays, sizes);
+    for (k = 0; k < SCENE_SECTIONS; k += 1)
+    {
+        size_t offset = header->offset[k];
+        if (offset % SCENE_FILE_ALIGN != 0 || offset < sizeof(CompiledSceneHeader) || offset > length || sizes[k] > length - offset)
+        {
+            fprintf(stderr, "Error: Compiled scene \"%s\" is corrupt.\n", filename);
+            exit(1);
+        }
+        *arrays[k] = data + offset;
+    }
+    scene->mapping = data;
+    scene->mappingLength = length;
+    return 1;
+}
+
+//this function takes in the scene parsed from the input json file, which holds the objects and lights and the bvh built over them,
+//and a buffer to store the data of each pixel.  It then uses the camera information to display the intersections
+//of raycasts and the objects those raycasts are hitting to store RGB pixel values for that spot of intersection
+//as observed by the camera position.  It also illuminates those objects based on the information in the lights buffer.
+//The image is split into tiles which are rendered by nthreads worker threads, whose counters are added up into stats.
+void store_pixels(Scene* scene, Pixel* data, float* hdr, RayStats* stats)
+{
+    Object* objects = scene->objects;
+    Real cx, cy, h, w;
+    cx = 0;  //default camera values
+    cy = 0;  // ||
+    h = 1;   // ||
+    w = 1;   // ||
+    int i;
+    int found = 0; //tell whether a camera is found or not
+    for (i=0; i < scene->numOfObjects; i += 1) //get the first camera's x/y positions and width/height
+    {
+        if(objects[i].kind == 0)
+        {
+            w = objects[i].camera.width;
+            h = objects[i].camera.height;
+            cx = objects[i].camera.center[0];
+            cy = objects[i].camera.center[1];
+            found = 1;
+            break;
+        }
+    }
+    int report = stream_rows == 0 || stream_band == 0; //a streamed image only reports on its first band
+    if(found != 1 && report) //if a camera was not found in the list of objects, print an error but continue with default camera values
+    {
+        fprintf(stderr, "Error: A camera object was not found in the input json file.\n\tUsing default camera position: (%f,%f)\n\tUsing default camera width: %f\n\tUsing default camera height: %f\n", cx, cy, w, h);
+    }
+
+    int M = frame_height; //M is equal to the input command line height
+    int N = frame_width;  //N is equal to the input command line width
+
+    //a --region is rendered as a window of the full frame.  When anti-aliasing, the window takes in one more pixel on
+    //each side where the frame has one, so the pixels on the region's edges are compared with the same neighbors as in
+    //a render of the whole frame, and the extra pixels are cropped off at the end.
+    int width = pwidth;
+    int height = pheight;
+    int left = 0, top = 0, right = 0, bottom = 0;
+    Pixel* image = data;
+    float* imageHdr = hdr;
+    if (aa_samples > 1)
+    {
+        left = region_x > 0;
+        top = region_y > 0;
+        right = region_x + pwidth < frame_width;
+        bottom = region_y + pheight < frame_height;
+    }
+    if (left + top + right + bottom > 0)
+    {
+        pwidth += left + right;
+        pheight += top + bottom;
+        region_x -= left;
+        region_y -= top;
+        data = malloc(sizeof(Pixel)*pwidth*pheight);
+        if (hdr != NULL) hdr = malloc(sizeof(float)*pwidth*pheight*3);
+    }
+
+    RenderJob job;
+    job.scene = scene;
+    job.data = data;
+    job.hdr = hdr;
+    job.cx = cx;
+    job.cy = cy;
+    job.w = w;
+    job.h = h;
+    job.pixheight = h / M; //pixel height and width of the area to be raycasted
+    job.pixwidth = w / N;
+    job.originX = region_x;
+    job.originY = frame_height - region_y - pheight;
+    job.keepX0 = left; //y grows upward, so the bottom border comes first
+    job.keepY0 = bottom;
+    job.keepX1 = pwidth - right;
+    job.keepY1 = pheight - top;
+    job.frameWidth = frame_width;
+    job.tilesX = (pwidth + TILE_SIZE - 1) / TILE_SIZE;
+    job.tilesY = (pheight + TILE_SIZE - 1) / TILE_SIZE;
+    job.numOfTiles = job.tilesX * job.tilesY;
+    job.numOfWorkers = nthreads < job.numOfTiles ? nthreads : job.numOfTiles;
+
+    job.step = 0;
+    job.refine = 0;
+    job.deferred = 0;
+    job.gbuffer = NULL;
+    job.order = NULL;
+    job.numOfOrdered = 0;
+    job.samples = NULL;
+    if (aa_samples > 1) job.samples = malloc(sizeof(Sample)*pwidth*pheight);
+    memset(stats, 0, sizeof(RayStats));
+
+    //with a hit cache that matches the geometry and camera, only the shading is redone.  Otherwise the hits are kept
+    //while rendering and saved for the next render.
+    job.hits = NULL;
+    job.reuseHits = 0;
+    unsigned long long hash = 0;
+    if (hit_cache_filename != NULL)
+    {
+        job.hits = malloc(sizeof(PrimaryHit)*pwidth*pheight);
+        hash = hit_cache_hash(&job);
+        job.reuseHits = load_hit_cache(&job, hash);
+        printf("Hit cache: %s\n", job.reuseHits ? "reusing the primary hits" : "recording the primary hits");
+    }
+
+    if (report) printf("calculating intersections and storing intersection pixels...\n");
+    if (deferred)
+    {
+        render_deferred(&job, stats);
+    }
+    else if (!progressive)
+    {
+        render_job(&job, stats);
+    }
+    else
+    {
+        //render every PROGRESSIVE_STEP-th pixel first, then halve the spacing each pass until every pixel is done
+        for (job.step = PROGRESSIVE_STEP; job.step >= 1; job.step /= 2)
+        {
+            render_job(&job, stats);
+            printf("finished pass with step %d\n", job.step);
+            if (preview_filename != NULL && (job.step > 1 || job.samples != NULL)) write_preview(data, hdr);
+        }
+        job.step = 0;
+    }
+
+    if (job.samples != NULL) //once every pixel has its first sample, give more to the ones on edges
+    {
+        job.refine = 1;
+        render_job(&job, stats);
+        if (stream_rows == 0)
+        {
+            printf("Anti-aliasing: %llu of %d pixels refined, %.2f samples per pixel on average\n",
+                   stats->refinedPixels, pwidth*pheight, (Real)stats->samples / ((Real)pwidth*pheight));
+        }
+        free(job.samples);
+    }
+
+    if (job.hits != NULL)
+    {
+        if (!job.reuseHits) save_hit_cache(&job, hash);
+        free(job.hits);
+    }
+
+    if (data != image) //crop the window back down to the region
+    {
+        int y;
+        for (y = 0; y < height; y += 1)
+        {
+            memcpy(&image[y*width], &data[(y + top)*pwidth + left], sizeof(Pixel)*width);
+            if (hdr != NULL) memcpy(&imageHdr[y*width*3], &hdr[((y + top)*pwidth + left)*3], sizeof(float)*width*3);
+        }
+        free(data);
+        free(hdr);
+        pwidth = width;
+        pheight = height;
+        region_x += left;
+        region_y += top;
+    }
+}
+
+//this function renders the image in bands of stream_rows rows from the top down, and encodes and writes each band to
+//the output file as soon as it is finished, so only one band's pixels are ever held in memory.  Each band is rendered
+//by every render thread as a region of the frame, so its pixels are identical to those of a render of the whole image.
+void stream_image(Scene* scene, char* filename, Pixel* data, float* hdr, RayStats* stats)
+{
+    int height = pheight; //height and position of the whole image, which each band's stand in for while it is rendered
+    int top = region_y;
+    RayStats band;
+    int row, y;
+    memset(stats, 0, sizeof(RayStats));
+    open_output(filename);
+    output_format->begin();
+    for (row = 0, stream_band = 0; row < height; row += stream_rows, stream_band += 1)
+    {
+        pheight = height - row < stream_rows ? height - row : stream_rows;
+        region_y = top + row;
+        store_pixels(scene, data, hdr, &band);
+        merge_stats(stats, &band);
+        int rows = pheight;
+        pheight = height;
+        region_y = top;
+        for (y = 0; y < rows; y += 1) //hand the band's rows to the writer as rows of the whole image
+        {
+            output_format->row(&data[y*pwidth], hdr != NULL ? &hdr[y*pwidth*3] : NULL, row + y);
+        }
+    }
+    close_output(output_format->end());
+    printf("Streamed %d bands of %d rows\n", stream_band, stream_rows);
+    if (aa_samples > 1)
+    {
+        printf("Anti-aliasing: %llu of %d pixels refined, %.2f samples per pixel on average\n",
+               stats->refinedPixels, pwidth*pheight, (Real)stats->samples / ((Real)pwidth*pheight));
+    }
+}
+
+//this function returns the time in seconds on a clock that only ever moves forward
+double now_seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+//this function renders the image once with precise math and once with --fast-math, leaving the fast image in data, and
+//prints how far it strays from the precise one: the largest and the mean difference of a color channel in steps out of
+//255, how many pixels differ at all and by more than 2 steps, and how long each render took
+void compare_fast_math(Scene* scene, Pixel* data, float* hdr, RayStats* stats)
+{
+    Pixel* precise = malloc(sizeof(Pixel)*pwidth*pheight);
+    if (precise == NULL)
+    {
+        fprintf(stderr, "Error: Not enough memory for the precise image to compare --fast-math with.\n");
+        exit(1);
+    }
+    fast_math = 0;
+    double start = now_seconds();
+    store_pixels(scene, precise, NULL, stats);
+    double preciseTime = now_seconds() - start;
+    fast_math = 1;
+    start = now_seconds();
+    store_pixels(scene, data, hdr, stats);
+    double fastTime = now_seconds() - start;
+
+    int most = 0;
+    unsigned long long total = 0;
+    int differ = 0, differ2 = 0;
+    int i, k;
+    for (i = 0; i < pwidth*pheight; i += 1)
+    {
+        unsigned char* a = &precise[i].r;
+        unsigned char* b = &data[i].r;
+        int worst = 0;
+        for (k = 0; k < 3; k += 1)
+        {
+            int difference = abs((int)a[k] - (int)b[k]);
+            total += difference;
+            if (difference > worst) worst = difference;
+        }
+        if (worst > most) most = worst;
+        if (worst > 0) differ += 1;
+        if (worst > 2) differ2 += 1;
+    }
+    free(precise);
+    printf("Fast math: max error %d, mean error %.4f steps out of 255; %d pixels differ (%.2f%%), %d by more than 2 steps (%.2f%%)\n",
+           most, (double)total / (3.0*pwidth*pheight), differ, 100.0*differ / ((double)pwidth*pheight),
+           differ2, 100.0*differ2 / ((double)pwidth*pheight));
+    printf("Fast math: precise render %.3f ms, fast render %.3f ms (%.2fx)\n", preciseTime*1000, fastTime*1000,
+           preciseTime / fastTime);
+}
+
+//this function orders two doubles for qsort
+int compare_doubles(const void* a, const void* b)
+{
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+//this function returns a newly allocated copy of the given string that can be placed between quotes in json,
+//with quotes, backslashes, and control characters escaped
+char* json_escape(char* input)
+{
+    char* output = malloc(6*strlen(input) + 1); //no character takes more than six to escape
+    if(output == NULL)
+    {
+        fprintf(stderr, "Error: Not enough memory to escape \"%s\" for json.\n", input);
+        exit(1);
+    }
+    char* out = output;
+    unsigned char* c;
+    for(c = (unsigned char*)input; *c != '\0'; c++)
+    {
+        if(*c == '"' || *c == '\\') out += sprintf(out, "\\%c", *c);
+        else if(*c == '\n') out += sprintf(out, "\\n");
+        else if(*c == '\t') out += sprintf(out, "\\t");
+        else if(*c < 0x20) out += sprintf(out, "\\u%04x", *c);
+        else *out++ = *c;
+    }
+    *out = '\0';
+    return output;
+}
+
+//this function sorts the given timings and finds their minimum, median, and 95th percentile (nearest rank)
+void summarize_timings(double* times, int count, double* min, double* median, double* p95)
+{
+    qsort(times, count, sizeof(double), compare_doubles);
+    *min = times[0];
+    *median = count % 2 == 1 ? times[count/2] : (times[count/2-1] + times[count/2]) / 2;
+    int rank = (int)ceil(0.95 * count);
+    *p95 = times[rank > 0 ? rank-1 : 0];
+}
+
+
+//this function returns the override's value after checking that it is a number (count 1) or a vector (count 3)
+Real* override_value(Override* o, int count, int job)
+{
+    if (o->count != count)
+    {
+        fprintf(stderr, "Error: Job %d sets \"%s\" to a %s, expected a %s.\n", job, o->key,
+                o->count == 3 ? "vector" : "number", count == 3 ? "vector" : "number");
+        exit(1);
+    }
+    return o->value;
+}
+
+//this function applies one of a batch job's overrides to the parsed objects and lights of its scene.  Only properties
+//that leave the bvh alone can be changed: colors, lights, materials, and the camera.  Geometry needs its own scene file.
+void apply_override(Scene* scene, Override* o, int job)
+{
+    int k;
+    if (o->light >= 0)
+    {
+        if (o->light >= scene->numOfLights)
+        {
+            fprintf(stderr, "Error: Job %d overrides light %d, but its scene has %d lights.\n", job, o->light, scene->numOfLights);
+            exit(1);
+        }
+        Light* light = &scene->lights[o->light];
+        if (strcmp(o->key, "color") == 0)
+        {
+            Real* v = override_value(o, 3, job);
+            for (k = 0; k < 3; k += 1) light->color[k] = v[k];
+        }
+        else if (strcmp(o->key, "position") == 0)
+        {
+            Real* v = override_value(o, 3, job);
+            for (k = 0; k < 3; k += 1) light->position[k] = v[k];
+        }
+        else if (strcmp(o->key, "radial-a0") == 0 || strcmp(o->key, "radial-a1") == 0 || strcmp(o->key, "radial-a2") == 0)
+        {
+            Real v = *override_value(o, 1, job);
+            if (v < 0)
+            {
+                fprintf(stderr, "Error: Job %d sets %s of light %d to a negative number.\n", job, o->key, o->light);
+                exit(1);
+            }
+            if (o->key[8] == '0') light->radial_a0 = v;
+            else if (o->key[8] == '1') light->radial_a1 = v;
+            else light->radial_a2 = v;
+        }
+        else if (light->kind == 1 && strcmp(o->key, "direction") == 0)
+        {
+            Real* v = override_value(o, 3, job);
+            for (k = 0; k < 3; k += 1) light->spotlight.direction[k] = v[k];
+        }
+        else if (light->kind == 1 && strcmp(o->key, "angular-a0") == 0)
+        {
+            Real v = *override_value(o, 1, job);
+            if (v < 0)
+            {
+                fprintf(stderr, "Error: Job %d sets angular-a0 of light %d to a negative number.\n", job, o->light);
+                exit(1);
+            }
+            light->spotlight.angular_a0 = v;
+        }
+        else if (light->kind == 1 && strcmp(o->key, "theta") == 0)
+        {
+            light->theta = *override_value(o, 1, job);
+        }
+        else
+        {
+            fprintf(stderr, "Error: Job %d can't override \"%s\" of light %d.\n", job, o->key, o->light);
+            exit(1);
+        }
+        return;
+    }
+
+    if (o->object >= scene->numOfObjects)
+    {
+        fprintf(stderr, "Error: Job %d overrides object %d, but its scene has %d objects.\n", job, o->object, scene->numOfObjects);
+        exit(1);
+    }
+    Object* object = &scene->objects[o->object];
+    if (object->kind == 0 && (strcmp(o->key, "width") == 0 || strcmp(o->key, "height") == 0))
+    {
+        Real v = *override_value(o, 1, job);
+        if (o->key[0] == 'w') object->camera.width = v;
+        else object->camera.height = v;
+    }
+    else if (object->kind == 0 && strcmp(o->key, "position") == 0)
+    {
+        Real* v = override_value(o, 3, job);
+        for (k = 0; k < 3; k += 1) object->camera.center[k] = v[k];
+    }
+    else if (object->kind != 0 && (strcmp(o->key, "diffuse_color") == 0 || strcmp(o->key, "specular_color") == 0))
+    {
+        Real* v = override_value(o, 3, job);
+        if (o->key[0] == 'd' && (v[0] > 1 || v[0] < 0 || v[1] > 1 || v[1] < 0 || v[2] > 1 || v[2] < 0))
+        {
+            fprintf(stderr, "Error: Job %d sets diffuse_color of object %d to a color value that is not 0.0 to 1.0.\n", job, o->object);
+            exit(1);
+        }
+        for (k = 0; k < 3; k += 1)
+        {
+            if (o->key[0] == 'd') object->diffuse_color[k] = v[k];
+            else object->specular_color[k] = v[k];
+        }
+    }
+    else if (object->kind != 0 && strcmp(o->key, "reflectivity") == 0)
+    {
+        object->sphere.reflectivity = *override_value(o, 1, job);
+    }
+    else if (object->kind != 0 && strcmp(o->key, "refractivity") == 0)
+    {
+        object->sphere.refractivity = *override_value(o, 1, job);
+    }
+    else if (object->kind != 0 && strcmp(o->key, "ior") == 0)
+    {
+        object->sphere.ior = *override_value(o, 1, job);
+    }
+    else
+    {
+        fprintf(stderr, "Error: Job %d can't override \"%s\" of object %d.\n", job, o->key, o->object);
+        exit(1);
+    }
+}
+
+//this function puts a batch scene's objects and lights back the way they were parsed and then applies the job's
+//overrides to them.  Nothing is done if neither the job nor the last job to use the scene changed anything.
+//It returns 1 if the scene's shading needs to be compiled again.
+int prepare_batch_scene(BatchScene* batchScene, BatchJob* job, int index)
+{
+    Scene* scene = &batchScene->scene;
+    int i;
+    if (!batchScene->dirty && job->numOfOverrides == 0) return 0;
+    memcpy(scene->objects, batchScene->objects, sizeof(Object)*scene->numOfObjects);
+    memcpy(scene->lights, batchScene->lights, sizeof(Light)*scene->numOfLights);
+    for (i = 0; i < job->numOfOverrides; i += 1)
+    {
+        apply_override(scene, &job->overrides[i], index);
+    }
+    batchScene->dirty = job->numOfOverrides > 0;
+    return 1;
+}
+
+//this function renders every job of a batch manifest back to back.  Each distinct scene file is parsed and compiled
+//once, before anything is rendered, so that a mistake in any job is reported before time is spent on the others.
+//The pixel buffers are sized for the largest job and reused, and the render threads are kept from one job to the next.
+void run_batch(char* manifest, char* format)
+{
+    BatchJob* jobs;
+    int numOfJobs = read_batch(manifest, &jobs);
+    BatchScene* scenes = NULL;
+    int numOfScenes = 0;
+    int sceneCapacity = 0;
+    size_t largest = 0;
+    int keepHdr = 0;
+    int i, j;
+    double start = now_seconds();
+    for (i = 0; i < numOfJobs; i += 1)
+    {
+        BatchJob* job = &jobs[i];
+        for (j = 0; j < numOfScenes && strcmp(scenes[j].filename, job->scene) != 0; j += 1);
+        if (j == numOfScenes) //parse and compile a scene the first time a job uses it
+        {
+            scenes = grow_array(scenes, numOfScenes, &sceneCapacity, sizeof(BatchScene));
+            BatchScene* batchScene = &scenes[numOfScenes++];
+            batchScene->filename = job->scene;
+            if (!load_compiled_scene(job->scene, &batchScene->scene))
+            {
+                if (read_scene(job->scene, &batchScene->scene) != 1)
+                {
+                    exit(1);
+                }
+                compile_scene(&batchScene->scene);
+            }
+            Scene* scene = &batchScene->scene;
+            batchScene->objects = malloc(sizeof(Object)*(scene->numOfObjects + 1));
+            batchScene->lights = malloc(sizeof(Light)*(scene->numOfLights + 1));
+            memcpy(batchScene->objects, scene->objects, sizeof(Object)*scene->numOfObjects);
+            memcpy(batchScene->lights, scene->lights, sizeof(Light)*scene->numOfLights);
+            batchScene->dirty = 0;
+            printf("Scene %s: %d objects, %d lights, %.1f KB\n", job->scene, scene->numOfObjects, scene->numOfLights,
+                   scene_memory(scene)/1024.0);
+        }
+        job->sceneIndex = j;
+        prepare_batch_scene(&scenes[j], job, i); //check the job's overrides, the job that renders the scene next undoes them
+        job->format = find_output_format(format, job->output);
+        if (job->format == NULL)
+        {
+            fprintf(stderr, "Error: Unknown output format '%s'.\n", format);
+            exit(1);
+        }
+        if ((size_t)job->width * job->height > largest) largest = (size_t)job->width * job->height;
+        if (job->format->hdr) keepHdr = 1;
+    }
+    printf("Batch: %d jobs, %d scenes parsed in %.3f ms\n", numOfJobs, numOfScenes, (now_seconds() - start)*1000);
+
+    Pixel* data = malloc(sizeof(Pixel)*largest); //allocate memory to hold the pixel data of the largest job
+    float* hdr = NULL;
+    if (keepHdr) hdr = malloc(sizeof(float)*largest*3); //and the unclamped colors if any job's format keeps them
+    RayStats stats;
+    for (i = 0; i < numOfJobs; i += 1)
+    {
+        BatchJob* job = &jobs[i];
+        BatchScene* batchScene = &scenes[job->sceneIndex];
+        double jobStart = now_seconds();
+        pwidth = frame_width = job->width;
+        pheight = frame_height = job->height;
+        region_x = region_y = 0;
+        output_format = job->format;
+        if (progressive) preview_filename = job->output;
+        if (prepare_batch_scene(batchScene, job, i)) compile_shading(&batchScene->scene);
+        store_pixels(&batchScene->scene, data, job->format->hdr ? hdr : NULL, &stats);
+        write_output(job->output, data, job->format->hdr ? hdr : NULL);
+        if (collect_stats) print_stats(&stats);
+        printf("Job %d: %s %dx%d -> %s (%s) in %.3f ms, %llu rays\n", i, job->scene, pwidth, pheight, job->output,
+               output_format->name, (now_seconds() - jobStart)*1000, total_rays(&stats));
+    }
+    printf("Batch: %d jobs in %.3f ms\n", numOfJobs, (now_seconds() - start)*1000);
+
+    for (j = 0; j < numOfScenes; j += 1)
+    {
+        free_scene(&scenes[j].scene);
+        free(scenes[j].objects);
+        free(scenes[j].lights);
+    }
+    for (i = 0; i < numOfJobs; i += 1)
+    {
+        free(jobs[i].scene);
+        free(jobs[i].output);
+        free(jobs[i].overrides);
+    }
+    free(scenes);
+    free(jobs);
+    free(data);
+    free(hdr);
+}
+
+//this function reads the next number of a ppm header, skipping whitespace and comments.  A "# region" comment written
+//by a --region render is read into region as x0, y0, x1, y1, frame width, frame height.  It returns -1 if no number is next.
+int ppm_number(SceneFile* image, int* region)
 {
-    if(argc != 5)
+    while (image->position < image->length)
     {
-        fprintf(stderr, "Error: Insufficient parameter amount.\nProper input: width height input_filename.json output_filename.ppm\n\n");
-        exit(1); //exit the program if there are insufficient arguments
+        char c = image->data[image->position];
+        if (c == '#') //a comment runs to the end of its line
+        {
+            char comment[128];
+            size_t length = 0;
+            while (image->position < image->length && image->data[image->position] != '\n')
+            {
+                if (length < sizeof(comment) - 1) comment[length++] = image->data[image->position];
+                image->position += 1;
+            }
+            comment[length] = '\0';
+            int r[6];
+            if (sscanf(comment, "# region %d %d %d %d of %d %d", &r[0], &r[1], &r[2], &r[3], &r[4], &r[5]) == 6)
+            {
+                memcpy(region, r, sizeof(r));
+            }
+        }
+        else if (isspace((unsigned char)c)) image->position += 1;
+        else break;
     }
-    //echo the command line arguments
-    printf("Arg 0: %s\n", argv[0]);
-    printf("Arg 1: %s\n", argv[1]);
-    printf("Arg 2: %s\n", argv[2]);
-    printf("Arg 3: %s\n", argv[3]);
-    printf("Arg 4: %s\n", argv[4]);
+    if (image->position >= image->length || !isdigit((unsigned char)image->data[image->position])) return -1;
+    int value = 0;
+    while (image->position < image->length && isdigit((unsigned char)image->data[image->position]) && value < 100000000)
+    {
+        value = value*10 + image->data[image->position++] - '0';
+    }
+    return value;
+}
 
-    outputfp = fopen(argv[4], "wb"); //open output to write to binary
-    if (outputfp == 0)
+//this function copies a p6 or p3 region image written by --region into its place in the full frame's pixel buffer,
+//allocating the buffer and setting the frame size from the first region read.  covered counts the regions that have
+//written each pixel, so that overlapping regions are caught.  An image without a region comment is a whole frame.
+void merge_region(char* filename, Pixel** data, unsigned char** covered)
+{
+    SceneFile file;
+    map_file(filename, &file);
+    int region[6] = {-1, -1, -1, -1, -1, -1};
+    int binary = file.length >= 2 && file.data[0] == 'P' && file.data[1] == '6';
+    if (file.length < 2 || file.data[0] != 'P' || (file.data[1] != '6' && file.data[1] != '3'))
     {
-        fprintf(stderr, "Error: Output file \"%s\" could not be opened.\n", argv[3]);
-        exit(1); //if the file cannot be opened, exit the program
+        fprintf(stderr, "Error: Region image \"%s\" is not a p6 or p3 ppm file.\n", filename);
+        exit(1);
+    }
+    file.position = 2;
+    int width = ppm_number(&file, region);
+    int height = ppm_number(&file, region);
+    int max = ppm_number(&file, region);
+    if (width <= 0 || height <= 0 || max != 255)
+    {
+        fprintf(stderr, "Error: Region image \"%s\" has a malformed header.\n", filename);
+        exit(1);
+    }
+    if (region[0] == -1) //a whole frame
+    {
+        region[0] = region[1] = 0;
+        region[2] = region[4] = width;
+        region[3] = region[5] = height;
+    }
+    if (*data == NULL)
+    {
+        frame_width = region[4];
+        frame_height = region[5];
+        *data = malloc(sizeof(Pixel)*frame_width*frame_height);
+        *covered = calloc((size_t)frame_width*frame_height, 1);
+    }
+    if (region[4] != frame_width || region[5] != frame_height || region[0] < 0 || region[1] < 0 ||
+            region[2] > frame_width || region[3] > frame_height || region[2] - region[0] != width || region[3] - region[1] != height)
+    {
+        fprintf(stderr, "Error: Region image \"%s\" doesn't fit the %dx%d frame of the first region.\n", filename, frame_width, frame_height);
+        exit(1);
+    }
+    if (binary && (file.position >= file.length || file.length - file.position - 1 < (size_t)width*height*3))
+    {
+        fprintf(stderr, "Error: Region image \"%s\" is missing pixels.\n", filename);
+        exit(1);
+    }
+    file.position += 1; //a single whitespace character separates the header from binary pixels
+    unsigned char* bytes = (unsigned char*)file.data + file.position;
+    int x, y, k;
+    for (y = 0; y < height; y += 1)
+    {
+        for (x = 0; x < width; x += 1)
+        {
+            size_t pixel = (size_t)(region[1] + y)*frame_width + region[0] + x;
+            unsigned char rgb[3];
+            for (k = 0; k < 3; k += 1)
+            {
+                int value = binary ? bytes[((size_t)y*width + x)*3 + k] : ppm_number(&file, region);
+                if (value < 0 || value > 255)
+                {
+                    fprintf(stderr, "Error: Region image \"%s\" is missing pixels.\n", filename);
+                    exit(1);
+                }
+                rgb[k] = value;
+            }
+            if ((*covered)[pixel]++ != 0)
+            {
+                fprintf(stderr, "Error: Region image \"%s\" overlaps another region at pixel (%d, %d).\n", filename, region[0] + x, region[1] + y);
+                exit(1);
+            }
+            (*data)[pixel].r = rgb[0];
+            (*data)[pixel].g = rgb[1];
+            (*data)[pixel].b = rgb[2];
+        }
+    }
+    munmap(file.data, file.length);
+}
+
+//this function assembles the region images rendered with --region into the full frame and writes it to the output file.
+//The regions must cover the frame exactly once between them.
+void merge_regions(char* output, char** regions, int numOfRegions, char* format)
+{
+    Pixel* data = NULL;
+    unsigned char* covered = NULL;
+    int i;
+    output_format = find_output_format(format, output);
+    if (output_format == NULL || output_format->hdr)
+    {
+        fprintf(stderr, "Error: Regions can only be merged into p6, p3, qoi, or png images.\n");
+        exit(1);
+    }
+    for (i = 0; i < numOfRegions; i += 1)
+    {
+        merge_region(regions[i], &data, &covered);
+    }
+    for (i = 0; i < frame_width*frame_height; i += 1)
+    {
+        if (!covered[i])
+        {
+            fprintf(stderr, "Error: No region covers pixel (%d, %d) of the %dx%d frame.\n", i % frame_width, i / frame_width, frame_width, frame_height);
+            exit(1);
+        }
     }
+    pwidth = frame_width;
+    pheight = frame_height;
+    region_x = region_y = 0;
+    write_output(output, data, NULL);
+    printf("Merged %d regions into %s (%dx%d, %s)\n", numOfRegions, output, pwidth, pheight, output_format->name);
+    free(data);
+    free(covered);
+}
 
-    Object* objects = malloc(sizeof(Object)*128);
-    Light* lights = malloc(sizeof(Light)*128);
+int main(int argc, char* argv[])
+{
+    char* args[5];      //positional arguments: program, width, height, input, output
+    int numOfArgs = 1;
+    args[0] = argv[0];
+    char* simd = "auto"; //packet kernel requested on the command line
+    char* format = NULL; //output format requested on the command line
+    int bench = 0;       //number of timed runs, 0 renders the image once without timing it
+    int warmup = 1;      //number of untimed runs before the timed ones
+    char* benchJson = NULL; //file the benchmark record is appended to
+    char* batch = NULL;  //batch manifest listing the images to render instead of the positional arguments
+    char* compileScene = NULL; //compiled scene file to write instead of rendering
+    int region[4] = {0, 0, 0, 0}; //x0, y0, x1, y1 of the --region of the frame to render, all 0 for the whole frame
+    char* merge = NULL;  //image that --merge assembles the region images listed after it into
+    char** regions = NULL;
+    int numOfRegions = 0;
+    int i;
+    for(i = 1; i < argc; i++)
+    {
+        if(strcmp(argv[i], "--threads") == 0)
+        {
+            if(i+1 >= argc)
+            {
+                fprintf(stderr, "Error: --threads expects a thread count.\n");
+                exit(1);
+            }
+            nthreads = atoi(argv[++i]);
+            if(nthreads == 0) nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN); //0 means use every core
+            if(nthreads <= 0)
+            {
+                fprintf(stderr, "Error: Thread count '%s' must be a positive number, or 0 for one per core.\n", argv[i]);
+                exit(1);
+            }
+        }
+        else if(strcmp(argv[i], "--simd") == 0)
+        {
+            if(i+1 >= argc)
+            {
+                fprintf(stderr, "Error: --simd expects auto, avx512, avx2, sse, or off.\n");
+                exit(1);
+            }
+            simd = argv[++i];
+        }
+        else if(strcmp(argv[i], "--format") == 0)
+        {
+            if(i+1 >= argc)
+            {
+                fprintf(stderr, "Error: --format expects p6, p3, pfm, qoi, or png.\n");
+                exit(1);
+            }
+            format = argv[++i];
+        }
+        else if(strcmp(argv[i], "--bench") == 0 || strcmp(argv[i], "--warmup") == 0)
+        {
+            if(i+1 >= argc)
+            {
+                fprintf(stderr, "Error: %s expects a number of runs.\n", argv[i]);
+                exit(1);
+            }
+            int runs = atoi(argv[i+1]);
+            if(runs < 0 || (runs == 0 && strcmp(argv[i], "--bench") == 0))
+            {
+                fprintf(stderr, "Error: Run count '%s' given to %s is not valid.\n", argv[i+1], argv[i]);
+                exit(1);
+            }
+            if(strcmp(argv[i], "--bench") == 0) bench = runs;
+            else warmup = runs;
+            i++;
+        }
+        else if(strcmp(argv[i], "--engine") == 0)
+        {
+            if(i+1 >= argc || (strcmp(argv[i+1], "recursive") != 0 && strcmp(argv[i+1], "wavefront") != 0))
+            {
+                fprintf(stderr, "Error: --engine expects recursive or wavefront.\n");
+                exit(1);
+            }
+            wavefront = strcmp(argv[++i], "wavefront") == 0;
+        }
+        else if(strcmp(argv[i], "--prune") == 0)
+        {
+            if(i+1 >= argc)
+            {
+                fprintf(stderr, "Error: --prune expects a weight, 0 follows every ray.\n");
+                exit(1);
+            }
+            char* end;
+            prune_threshold = strtod(argv[++i], &end);
+            if(*end != '\0' || prune_threshold < 0 || prune_threshold >= 1)
+            {
+                fprintf(stderr, "Error: Prune weight '%s' must be a number from 0 up to 1.\n", argv[i]);
+                exit(1);
+            }
+        }
+        else if(strcmp(argv[i], "--roulette") == 0)
+        {
+            roulette = 1;
+        }
+        else if(strcmp(argv[i], "--progressive") == 0)
+        {
+            progressive = 1;
+        }
+        else if(strcmp(argv[i], "--aa") == 0)
+        {
+            if(i+1 >= argc)
+            {
+                fprintf(stderr, "Error: --aa expects the largest number of samples per pixel.\n");
+                exit(1);
+            }
+            char* end;
+            aa_samples = (int)strtol(argv[++i], &end, 10);
+            if(*end != '\0' || end == argv[i] || (aa_samples != 1 && aa_samples < 5))
+            {
+                fprintf(stderr, "Error: Sample count '%s' must be 1 (no anti-aliasing) or at least 5.\n", argv[i]);
+                exit(1);
+            }
+        }
+        else if(strcmp(argv[i], "--aa-threshold") == 0)
+        {
+            if(i+1 >= argc)
+            {
+                fprintf(stderr, "Error: --aa-threshold expects a color difference.\n");
+                exit(1);
+            }
+            char* end;
+            aa_threshold = strtod(argv[++i], &end);
+            if(*end != '\0' || aa_threshold < 0)
+            {
+                fprintf(stderr, "Error: Color difference '%s' must be a number that isn't negative.\n", argv[i]);
+                exit(1);
+            }
+        }
+        else if(strcmp(argv[i], "--stats") == 0)
+        {
+            collect_stats = 1;
+        }
+        else if(strcmp(argv[i], "--deferred") == 0)
+        {
+            deferred = 1;
+        }
+        else if(strcmp(argv[i], "--gbuffer-dump") == 0)
+        {
+            if(i+1 >= argc)
+            {
+                fprintf(stderr, "Error: --gbuffer-dump expects a file name prefix.\n");
+                exit(1);
+            }
+            gbuffer_dump = argv[++i];
+            deferred = 1; //only the deferred renderer keeps a G-buffer
+        }
+        else if(strcmp(argv[i], "--fast-math") == 0)
+        {
+            fast_math = 1;
+        }
+        else if(strcmp(argv[i], "--fast-math-check") == 0)
+        {
+            fast_math = 1;
+            fast_math_check = 1;
+        }
+        else if(strcmp(argv[i], "--stream") == 0)
+        {
+            if(i+1 >= argc || (stream_rows = atoi(argv[i+1])) <= 0)
+            {
+                fprintf(stderr, "Error: --stream expects the number of rows to render and write at a time.\n");
+                exit(1);
+            }
+            i++;
+        }
+        else if(strcmp(argv[i], "--hit-cache") == 0)
+        {
+            if(i+1 >= argc)
+            {
+                fprintf(stderr, "Error: --hit-cache expects a file name.\n");
+                exit(1);
+            }
+            hit_cache_filename = argv[++i];
+        }
+        else if(strcmp(argv[i], "--batch") == 0)
+        {
+            if(i+1 >= argc)
+            {
+                fprintf(stderr, "Error: --batch expects a manifest file name.\n");
+                exit(1);
+            }
+            batch = argv[++i];
+        }
+        else if(strcmp(argv[i], "--compile-scene") == 0)
+        {
+            if(i+1 >= argc)
+            {
+                fprintf(stderr, "Error: --compile-scene expects a file name.\n");
+                exit(1);
+            }
+            compileScene = argv[++i];
+        }
+        else if(strcmp(argv[i], "--region") == 0)
+        {
+            char end;
+            if(i+1 >= argc || sscanf(argv[i+1], "%d,%d,%d,%d%c", &region[0], &region[1], &region[2], &region[3], &end) != 4 ||
+                    region[0] < 0 || region[1] < 0 || region[2] <= region[0] || region[3] <= region[1])
+            {
+                fprintf(stderr, "Error: --region expects x0,y0,x1,y1 with x0 < x1 and y0 < y1, counting pixels from the top left.\n");
+                exit(1);
+            }
+            i++;
+        }
+        else if(strcmp(argv[i], "--merge") == 0) //the output and every region image follow, so nothing after it is an option
+        {
+            if(i+2 >= argc)
+            {
+                fprintf(stderr, "Error: --merge expects an output file name followed by the region images.\n");
+                exit(1);
+            }
+            merge = argv[i+1];
+            regions = &argv[i+2];
+            numOfRegions = argc - (i+2);
+            break;
+        }
+        else if(strcmp(argv[i], "--bench-json") == 0)
+        {
+            if(i+1 >= argc)
+            {
+                fprintf(stderr, "Error: --bench-json expects a file name.\n");
+                exit(1);
+            }
+            benchJson = argv[++i];
+        }
+        else if(numOfArgs < 5)
+        {
+            args[numOfArgs++] = argv[i];
+        }
+        else
+        {
+            numOfArgs++; //too many arguments, reported below
+        }
+    }
+    if(numOfArgs != (batch != NULL || merge != NULL ? 1 : compileScene != NULL ? 2 : 5) ||
+            (batch != NULL) + (compileScene != NULL) + (merge != NULL) > 1)
+    {
+        fprintf(stderr, "Error: Insufficient parameter amount.\nProper input: [--threads N] [--simd auto|avx512|avx2|sse|off] [--format p6|p3|pfm|qoi|png] [--bench N [--warmup N] [--bench-json file]] [--stats] [--engine recursive|wavefront] [--prune weight] [--roulette] [--progressive] [--aa samples] [--aa-threshold difference] [--hit-cache file] [--deferred [--gbuffer-dump prefix]] [--stream rows] [--fast-math | --fast-math-check] width height input_filename.json output_filename.ppm\n"
+                "   or: [options] --batch manifest.json\n"
+                "   or: --compile-scene output_filename.bin input_filename.json\n"
+                "   or: [--format p6|p3|qoi|png] --merge output_filename.ppm region.ppm...\n"
+                "where [options] also takes [--region x0,y0,x1,y1] to render only that window of the width by height frame\n\n");
+        exit(1); //exit the program if there are insufficient arguments
+    }
+    if(deferred && (wavefront || progressive))
+    {
+        fprintf(stderr, "Error: --deferred can't be combined with --engine wavefront or --progressive.\n");
+        exit(1);
+    }
+    if(batch != NULL && bench > 0)
+    {
+        fprintf(stderr, "Error: --batch can't be combined with --bench.\n");
+        exit(1);
+    }
+    if(batch != NULL && region[2] > 0)
+    {
+        fprintf(stderr, "Error: --batch can't be combined with --region.\n");
+        exit(1);
+    }
+    if(stream_rows > 0 && (batch != NULL || progressive || hit_cache_filename != NULL || gbuffer_dump != NULL))
+    {
+        fprintf(stderr, "Error: --stream can't be combined with --batch, --progressive, --hit-cache, or --gbuffer-dump.\n");
+        exit(1);
+    }
+    if(fast_math_check && (batch != NULL || bench > 0 || progressive || stream_rows > 0))
+    {
+        fprintf(stderr, "Error: --fast-math-check can't be combined with --batch, --bench, --progressive, or --stream.\n");
+        exit(1);
+    }
+    if(merge != NULL) //assemble the regions rendered by other runs into one image
+    {
+        merge_regions(merge, regions, numOfRegions, format);
+        return(0);
+    }
+    argv = args;
+    if(compileScene != NULL) //parse and compile the scene, then write it out for later renders to map instead of rendering it
+    {
+        Scene scene;
+        double start = now_seconds();
+        if(read_scene(argv[1], &scene) != 1)
+        {
+            exit(1);
+        }
+        compile_scene(&scene);
+        write_compiled_scene(compileScene, &scene, argv[1]);
+        printf("Compiled %s into %s in %.3f ms: %d objects, %d lights, %d BVH nodes\n", argv[1], compileScene,
+               (now_seconds() - start)*1000, scene.numOfObjects, scene.numOfLights, scene.numOfNodes);
+        free_scene(&scene);
+        return(0);
+    }
+    if(batch == NULL)
+    {
+        if(progressive) preview_filename = argv[4]; //each pass is written to the output file as it finishes
+        //echo the command line arguments
+        printf("Arg 0: %s\n", argv[0]);
+        printf("Arg 1: %s\n", argv[1]);
+        printf("Arg 2: %s\n", argv[2]);
+        printf("Arg 3: %s\n", argv[3]);
+        printf("Arg 4: %s\n", argv[4]);
+    }
+    printf("Threads: %d\n", nthreads);
+    printf("Precision: %s\n", sizeof(Real) == sizeof(float) ? "float" : "double");
+    if(select_packet_kernel(simd) != 1)
+    {
+        fprintf(stderr, "Error: Packet kernel '%s' is not supported on this processor.\n", simd);
+        exit(1);
+    }
+    printf("Packets: %s (%d rays)\n", packet_kernel, packet_width);
+    printf("Engine: %s\n", wavefront ? "wavefront" : "recursive");
+    if(fast_math) printf("Math: fast\n");
+    if(batch != NULL)
+    {
+        run_batch(batch, format);
+        stop_render_threads();
+        printf("closing...");
+        return(0);
+    }
+    output_format = find_output_format(format, argv[4]);
+    if(output_format == NULL)
+    {
+        fprintf(stderr, "Error: Unknown output format '%s'.\n", format);
+        exit(1);
+    }
+    printf("Format: %s\n", output_format->name);
 
     pwidth = atoi(argv[1]);
     pheight = atoi(argv[2]);
@@ -1242,27 +4967,121 @@ int main(int argc, char* argv[])
         fprintf(stderr, "Error: Input height '%d' cannot be less than or equal to zero.\n", pheight);
         exit(1);
     }
-    int* parsedNums = read_scene(argv[3], &objects[0], &lights[0]);  //parse the scene and store the number of objects
-    int numOfObjects = parsedNums[0];
-    int numOfLights = parsedNums[1];
-    printf("# of Objects: %d\n", numOfObjects);           //echo the number of objects
-    printf("# of Lights : %d\n", numOfLights);           //echo the number of lights
-    Pixel* data = malloc(sizeof(Pixel)*pwidth*pheight*3); //allocate memory to hold all of the pixel data
+    frame_width = pwidth;
+    frame_height = pheight;
+    if(region[2] > 0) //the image is only the region, the camera still spans the whole frame
+    {
+        if(region[2] > frame_width || region[3] > frame_height)
+        {
+            fprintf(stderr, "Error: Region %d,%d,%d,%d doesn't fit in the %dx%d frame.\n", region[0], region[1], region[2], region[3],
+                    frame_width, frame_height);
+            exit(1);
+        }
+        region_x = region[0];
+        region_y = region[1];
+        pwidth = region[2] - region[0];
+        pheight = region[3] - region[1];
+        printf("Region: %d,%d to %d,%d of the %dx%d frame\n", region[0], region[1], region[2], region[3], frame_width, frame_height);
+    }
+    int rows = stream_rows > 0 && stream_rows < pheight ? stream_rows : pheight; //a streamed image only holds one band at a time
+    Pixel* data = malloc(sizeof(Pixel)*pwidth*rows); //allocate memory to hold all of the pixel data
+    float* hdr = NULL;
+    if(output_format->hdr) hdr = malloc(sizeof(float)*pwidth*rows*3); //and the unclamped colors if the format keeps them
+
+    //in benchmark mode the whole pipeline is run warmup+bench times and each phase of the timed runs is recorded
+    char* phases[4] = {"read_scene", "compile_scene", "store_pixels", "write_image"};
+    double* timings[4];
+    if(bench == 0) warmup = 0;
+    int runs = warmup + (bench > 0 ? bench : 1);
+    for(i = 0; i < 4; i++) timings[i] = malloc(sizeof(double)*(bench > 0 ? bench : 1));
+    RayStats stats;
+    int run;
+    for(run = 0; run < runs; run++)
+    {
+        double start[5];
+        start[0] = now_seconds();
+        Scene scene;
+        int mapped = load_compiled_scene(argv[3], &scene); //a compiled scene file is used where it is mapped
+        if(!mapped && read_scene(argv[3], &scene) != 1)  //otherwise parse the scene and store the objects and lights
+        {
+            exit(1);
+        }
+        start[1] = now_seconds();
+        if(!mapped) compile_scene(&scene);                    //compile the scene and build its bvh once, before any rays are shot
+        start[2] = now_seconds();
+        if(run == 0)
+        {
+            printf("Scene file: %s\n", mapped ? "compiled" : "json");
+            printf("# of Objects: %d\n", scene.numOfObjects);           //echo the number of objects
+            printf("# of Lights : %d\n", scene.numOfLights);           //echo the number of lights
+            printf("# of BVH Nodes: %d\n", scene.numOfNodes);
+            printf("Scene memory: %.1f KB\n", scene_memory(&scene)/1024.0);
+        }
 
+        if(stream_rows > 0) stream_image(&scene, argv[4], &data[0], hdr, &stats); //render and write the image one band at a time
+        else if(fast_math_check) compare_fast_math(&scene, &data[0], hdr, &stats); //render it precisely and fast, and report the difference
+        else store_pixels(&scene, &data[0], hdr, &stats);    //store the points of ray intersection and that object's color values into a buffer
+        start[3] = now_seconds();
 
-    store_pixels(numOfObjects, numOfLights, &objects[0], &data[0], &lights[0]);    //store the points of ray intersection and that object's color values into a buffer
-    maxcv = 255;
-    printf("writing to image file...\n");
-    int successfulWrite = write_p3(&data[0]);             //write the pixel buffer to the image file
-    if(successfulWrite != 1)
+        if(stream_rows == 0) write_output(argv[4], &data[0], hdr); //write the pixel buffer to the image file
+        start[4] = now_seconds();
+        free_scene(&scene); //free the memory being used
+        if(collect_stats && run == runs-1) print_stats(&stats);
+        if(run >= warmup)
+        {
+            for(i = 0; i < 4; i++) timings[i][run-warmup] = start[i+1] - start[i];
+        }
+    }
+
+    if(bench > 0) //report the minimum, median, and 95th percentile of each phase, then the same as one json record
     {
-        fprintf(stderr, "Error: Failed to properly write to output image file.\n");
-        exit(1);
+        double min[4], median[4], p95[4];
+        printf("\nBenchmark: %d runs after %d warm-up runs\n", bench, warmup);
+        for(i = 0; i < 4; i++)
+        {
+            summarize_timings(timings[i], bench, &min[i], &median[i], &p95[i]);
+            printf("%-14s min %10.3f ms   median %10.3f ms   p95 %10.3f ms\n", phases[i], min[i]*1000, median[i]*1000, p95[i]*1000);
+        }
+        unsigned long long rays = total_rays(&stats);
+        double raysPerSecond = rays / median[2];
+        double pixelsPerSecond = (double)pwidth * pheight / median[2];
+        printf("rays per frame: %llu\nrays/s (median render): %.0f\npixels/s (median render): %.0f\n", rays, raysPerSecond, pixelsPerSecond);
+
+        char* scene = json_escape(argv[3]);
+        char* format = json_escape(output_format->name);
+        size_t size = strlen(scene) + strlen(format) + 2048;
+        char* record = malloc(size);
+        int length = snprintf(record, size,
+                              "{\"scene\":\"%s\",\"width\":%d,\"height\":%d,\"threads\":%d,\"precision\":\"%s\",\"simd\":\"%s\",\"format\":\"%s\","
+                              "\"runs\":%d,\"warmup\":%d,\"rays\":%llu,\"rays_per_second\":%.0f,\"pixels_per_second\":%.0f,\"phases\":{",
+                              scene, pwidth, pheight, nthreads, sizeof(Real) == sizeof(float) ? "float" : "double", packet_kernel, format,
+                              bench, warmup, rays, raysPerSecond, pixelsPerSecond);
+        for(i = 0; i < 4; i++)
+        {
+            length += snprintf(record+length, size-length, "%s\"%s\":{\"min\":%.9f,\"median\":%.9f,\"p95\":%.9f}",
+                               i == 0 ? "" : ",", phases[i], min[i], median[i], p95[i]);
+        }
+        snprintf(record+length, size-length, "}}");
+        printf("%s\n", record);
+        if(benchJson != NULL)
+        {
+            FILE* jsonfp = fopen(benchJson, "a"); //append so that repeated benchmarks build up a json lines file
+            if(jsonfp == NULL)
+            {
+                fprintf(stderr, "Error: Benchmark file \"%s\" could not be opened.\n", benchJson);
+                exit(1);
+            }
+            fprintf(jsonfp, "%s\n", record);
+            fclose(jsonfp);
+        }
+        free(record);
+        free(format);
+        free(scene);
     }
-    fclose(outputfp); //close the output file
+    stop_render_threads();
     printf("closing...");
-    free(lights); //free the memory being used
-    free(objects);
+    for(i = 0; i < 4; i++) free(timings[i]);
     free(data);
+    free(hdr);
     return(0);
 }